@@ -1,76 +1,407 @@
 #include "ansi.h"
-#include <stdlib.h>
-
-void parse_ansi(const char *seq, int *fg_color, int *bg_color, int *attr) {
-  if (seq[0] == '[') {
-    char *end;
-    int param = strtol(seq + 1, &end, 10);
-
-    if (*end == 'm') {
-      switch (param) {
-      case 0:
-        *attr = 0;
-        *fg_color = ANSI_COLOR_WHITE;
-        *bg_color = ANSI_COLOR_BLACK;
-        break;
-      case 1: // Bold
-        *attr |= 1;
-        break;
-      case 30:
-        *fg_color = ANSI_COLOR_BLACK;
-        break;
-      case 31:
-        *fg_color = ANSI_COLOR_RED;
-        break;
-      case 32:
-        *fg_color = ANSI_COLOR_GREEN;
-        break;
-      case 33:
-        *fg_color = ANSI_COLOR_YELLOW;
-        break;
-      case 34:
-        *fg_color = ANSI_COLOR_BLUE;
-        break;
-      case 35:
-        *fg_color = ANSI_COLOR_MAGENTA;
-        break;
-      case 36:
-        *fg_color = ANSI_COLOR_CYAN;
-        break;
-      case 37:
-        *fg_color = ANSI_COLOR_WHITE;
-        break;
-      case 39: // Reset foreground color
-        *fg_color = ANSI_COLOR_WHITE;
-        break;
-      case 40:
-        *bg_color = ANSI_COLOR_BLACK;
-        break;
-      case 41:
-        *bg_color = ANSI_COLOR_RED;
-        break;
-      case 42:
-        *bg_color = ANSI_COLOR_GREEN;
-        break;
-      case 43:
-        *bg_color = ANSI_COLOR_YELLOW;
-        break;
-      case 44:
-        *bg_color = ANSI_COLOR_BLUE;
-        break;
-      case 45:
-        *bg_color = ANSI_COLOR_MAGENTA;
-        break;
-      case 46:
-        *bg_color = ANSI_COLOR_CYAN;
-        break;
-      case 47:
-        *bg_color = ANSI_COLOR_WHITE;
-        break;
-      case 49: // Reset background color
-        *bg_color = ANSI_COLOR_BLACK;
-        break;
-      }
+#include <string.h>
+
+// Byte classes. Every byte maps to exactly one class, and each state has a
+// transition for every class, so parsing is two table lookups per byte.
+enum {
+  C_C0,     // C0 controls other than the ones below
+  C_BEL,    // 0x07, terminates OSC
+  C_CANSUB, // 0x18, 0x1a: abort the current sequence
+  C_ESC,    // 0x1b
+  C_INTER,  // 0x20-0x2f intermediates
+  C_DIGIT,  // 0x30-0x39
+  C_SEP,    // ':' ';'
+  C_PRIV,   // 0x3c-0x3f private markers
+  C_FINAL,  // 0x40-0x7e except the introducers below
+  C_DCS,    // 'P'
+  C_SOS,    // 'X'
+  C_CSI,    // '['
+  C_OSC,    // ']'
+  C_PM_APC, // '^' '_'
+  C_DEL,    // 0x7f
+  C_HIGH,   // 0x80-0xff, UTF-8 in the ground state
+  C_COUNT
+};
+
+static const uint8_t byte_class[256] = {
+    [0x00 ... 0x1f] = C_C0,      [0x07] = C_BEL,
+    [0x18] = C_CANSUB,           [0x1a] = C_CANSUB,
+    [0x1b] = C_ESC,              [0x20 ... 0x2f] = C_INTER,
+    [0x30 ... 0x39] = C_DIGIT,   [0x3a ... 0x3b] = C_SEP,
+    [0x3c ... 0x3f] = C_PRIV,    [0x40 ... 0x7e] = C_FINAL,
+    ['P'] = C_DCS,               ['X'] = C_SOS,
+    ['['] = C_CSI,               [']'] = C_OSC,
+    ['^'] = C_PM_APC,            ['_'] = C_PM_APC,
+    [0x7f] = C_DEL,              [0x80 ... 0xff] = C_HIGH,
+};
+
+// Transition actions, run before the state change.
+enum {
+  A_NONE,
+  A_PRINT,
+  A_EXEC,
+  A_COLLECT,
+  A_PARAM,
+  A_ESC,
+  A_CSI,
+  A_OSC_PUT,
+  A_UTF8,
+};
+
+#define S(st) ANSI_##st
+#define T(act, st) (uint8_t)((A_##act << 4) | S(st))
+
+// Columns follow the class enum:
+//   C0 BEL CANSUB ESC INTER DIGIT SEP PRIV FINAL DCS SOS CSI OSC PM DEL HIGH
+static const uint8_t transitions[ANSI_STATE_COUNT][C_COUNT] = {
+    [ANSI_GROUND] = {T(EXEC, GROUND), T(EXEC, GROUND), T(EXEC, GROUND),
+                     T(NONE, ESCAPE), T(PRINT, GROUND), T(PRINT, GROUND),
+                     T(PRINT, GROUND), T(PRINT, GROUND), T(PRINT, GROUND),
+                     T(PRINT, GROUND), T(PRINT, GROUND), T(PRINT, GROUND),
+                     T(PRINT, GROUND), T(PRINT, GROUND), T(NONE, GROUND),
+                     T(UTF8, GROUND)},
+    [ANSI_ESCAPE] = {T(EXEC, ESCAPE), T(EXEC, ESCAPE), T(EXEC, GROUND),
+                     T(NONE, ESCAPE), T(COLLECT, ESCAPE_INTERMEDIATE),
+                     T(ESC, GROUND), T(ESC, GROUND), T(ESC, GROUND),
+                     T(ESC, GROUND), T(NONE, DCS_ENTRY),
+                     T(NONE, SOS_PM_APC_STRING), T(NONE, CSI_ENTRY),
+                     T(NONE, OSC_STRING), T(NONE, SOS_PM_APC_STRING),
+                     T(NONE, ESCAPE), T(NONE, ESCAPE)},
+    [ANSI_ESCAPE_INTERMEDIATE] =
+        {T(EXEC, ESCAPE_INTERMEDIATE), T(EXEC, ESCAPE_INTERMEDIATE),
+         T(EXEC, GROUND), T(NONE, ESCAPE),
+         T(COLLECT, ESCAPE_INTERMEDIATE), T(ESC, GROUND), T(ESC, GROUND),
+         T(ESC, GROUND), T(ESC, GROUND), T(ESC, GROUND), T(ESC, GROUND),
+         T(ESC, GROUND), T(ESC, GROUND), T(ESC, GROUND),
+         T(NONE, ESCAPE_INTERMEDIATE), T(NONE, ESCAPE_INTERMEDIATE)},
+    [ANSI_CSI_ENTRY] = {T(EXEC, CSI_ENTRY), T(EXEC, CSI_ENTRY),
+                        T(EXEC, GROUND), T(NONE, ESCAPE),
+                        T(COLLECT, CSI_INTERMEDIATE), T(PARAM, CSI_PARAM),
+                        T(PARAM, CSI_PARAM), T(COLLECT, CSI_PARAM),
+                        T(CSI, GROUND), T(CSI, GROUND), T(CSI, GROUND),
+                        T(CSI, GROUND), T(CSI, GROUND), T(CSI, GROUND),
+                        T(NONE, CSI_ENTRY), T(NONE, CSI_ENTRY)},
+    [ANSI_CSI_PARAM] = {T(EXEC, CSI_PARAM), T(EXEC, CSI_PARAM),
+                        T(EXEC, GROUND), T(NONE, ESCAPE),
+                        T(COLLECT, CSI_INTERMEDIATE), T(PARAM, CSI_PARAM),
+                        T(PARAM, CSI_PARAM), T(NONE, CSI_IGNORE),
+                        T(CSI, GROUND), T(CSI, GROUND), T(CSI, GROUND),
+                        T(CSI, GROUND), T(CSI, GROUND), T(CSI, GROUND),
+                        T(NONE, CSI_PARAM), T(NONE, CSI_PARAM)},
+    [ANSI_CSI_INTERMEDIATE] =
+        {T(EXEC, CSI_INTERMEDIATE), T(EXEC, CSI_INTERMEDIATE),
+         T(EXEC, GROUND), T(NONE, ESCAPE), T(COLLECT, CSI_INTERMEDIATE),
+         T(NONE, CSI_IGNORE), T(NONE, CSI_IGNORE), T(NONE, CSI_IGNORE),
+         T(CSI, GROUND), T(CSI, GROUND), T(CSI, GROUND), T(CSI, GROUND),
+         T(CSI, GROUND), T(CSI, GROUND), T(NONE, CSI_INTERMEDIATE),
+         T(NONE, CSI_INTERMEDIATE)},
+    [ANSI_CSI_IGNORE] = {T(EXEC, CSI_IGNORE), T(EXEC, CSI_IGNORE),
+                         T(EXEC, GROUND), T(NONE, ESCAPE),
+                         T(NONE, CSI_IGNORE), T(NONE, CSI_IGNORE),
+                         T(NONE, CSI_IGNORE), T(NONE, CSI_IGNORE),
+                         T(NONE, GROUND), T(NONE, GROUND), T(NONE, GROUND),
+                         T(NONE, GROUND), T(NONE, GROUND), T(NONE, GROUND),
+                         T(NONE, CSI_IGNORE), T(NONE, CSI_IGNORE)},
+    [ANSI_DCS_ENTRY] = {T(NONE, DCS_ENTRY), T(NONE, DCS_ENTRY),
+                        T(EXEC, GROUND), T(NONE, ESCAPE),
+                        T(COLLECT, DCS_INTERMEDIATE), T(PARAM, DCS_PARAM),
+                        T(PARAM, DCS_PARAM), T(COLLECT, DCS_PARAM),
+                        T(NONE, DCS_PASSTHROUGH), T(NONE, DCS_PASSTHROUGH),
+                        T(NONE, DCS_PASSTHROUGH), T(NONE, DCS_PASSTHROUGH),
+                        T(NONE, DCS_PASSTHROUGH), T(NONE, DCS_PASSTHROUGH),
+                        T(NONE, DCS_ENTRY), T(NONE, DCS_ENTRY)},
+    [ANSI_DCS_PARAM] = {T(NONE, DCS_PARAM), T(NONE, DCS_PARAM),
+                        T(EXEC, GROUND), T(NONE, ESCAPE),
+                        T(COLLECT, DCS_INTERMEDIATE), T(PARAM, DCS_PARAM),
+                        T(PARAM, DCS_PARAM), T(NONE, DCS_IGNORE),
+                        T(NONE, DCS_PASSTHROUGH), T(NONE, DCS_PASSTHROUGH),
+                        T(NONE, DCS_PASSTHROUGH), T(NONE, DCS_PASSTHROUGH),
+                        T(NONE, DCS_PASSTHROUGH), T(NONE, DCS_PASSTHROUGH),
+                        T(NONE, DCS_PARAM), T(NONE, DCS_PARAM)},
+    [ANSI_DCS_INTERMEDIATE] =
+        {T(NONE, DCS_INTERMEDIATE), T(NONE, DCS_INTERMEDIATE),
+         T(EXEC, GROUND), T(NONE, ESCAPE), T(COLLECT, DCS_INTERMEDIATE),
+         T(NONE, DCS_IGNORE), T(NONE, DCS_IGNORE), T(NONE, DCS_IGNORE),
+         T(NONE, DCS_PASSTHROUGH), T(NONE, DCS_PASSTHROUGH),
+         T(NONE, DCS_PASSTHROUGH), T(NONE, DCS_PASSTHROUGH),
+         T(NONE, DCS_PASSTHROUGH), T(NONE, DCS_PASSTHROUGH),
+         T(NONE, DCS_INTERMEDIATE), T(NONE, DCS_INTERMEDIATE)},
+    // DCS payloads are consumed but not interpreted.
+    [ANSI_DCS_PASSTHROUGH] =
+        {T(NONE, DCS_PASSTHROUGH), T(NONE, DCS_PASSTHROUGH), T(EXEC, GROUND),
+         T(NONE, ESCAPE), T(NONE, DCS_PASSTHROUGH), T(NONE, DCS_PASSTHROUGH),
+         T(NONE, DCS_PASSTHROUGH), T(NONE, DCS_PASSTHROUGH),
+         T(NONE, DCS_PASSTHROUGH), T(NONE, DCS_PASSTHROUGH),
+         T(NONE, DCS_PASSTHROUGH), T(NONE, DCS_PASSTHROUGH),
+         T(NONE, DCS_PASSTHROUGH), T(NONE, DCS_PASSTHROUGH),
+         T(NONE, DCS_PASSTHROUGH), T(NONE, DCS_PASSTHROUGH)},
+    [ANSI_DCS_IGNORE] = {T(NONE, DCS_IGNORE), T(NONE, DCS_IGNORE),
+                         T(EXEC, GROUND), T(NONE, ESCAPE),
+                         T(NONE, DCS_IGNORE), T(NONE, DCS_IGNORE),
+                         T(NONE, DCS_IGNORE), T(NONE, DCS_IGNORE),
+                         T(NONE, DCS_IGNORE), T(NONE, DCS_IGNORE),
+                         T(NONE, DCS_IGNORE), T(NONE, DCS_IGNORE),
+                         T(NONE, DCS_IGNORE), T(NONE, DCS_IGNORE),
+                         T(NONE, DCS_IGNORE), T(NONE, DCS_IGNORE)},
+    // BEL and ST (ESC \) both terminate an OSC string; the dispatch is
+    // reported when the state is left.
+    [ANSI_OSC_STRING] = {T(NONE, OSC_STRING), T(NONE, GROUND),
+                         T(EXEC, GROUND), T(NONE, ESCAPE),
+                         T(OSC_PUT, OSC_STRING), T(OSC_PUT, OSC_STRING),
+                         T(OSC_PUT, OSC_STRING), T(OSC_PUT, OSC_STRING),
+                         T(OSC_PUT, OSC_STRING), T(OSC_PUT, OSC_STRING),
+                         T(OSC_PUT, OSC_STRING), T(OSC_PUT, OSC_STRING),
+                         T(OSC_PUT, OSC_STRING), T(OSC_PUT, OSC_STRING),
+                         T(NONE, OSC_STRING), T(OSC_PUT, OSC_STRING)},
+    [ANSI_SOS_PM_APC_STRING] =
+        {T(NONE, SOS_PM_APC_STRING), T(NONE, SOS_PM_APC_STRING),
+         T(EXEC, GROUND), T(NONE, ESCAPE), T(NONE, SOS_PM_APC_STRING),
+         T(NONE, SOS_PM_APC_STRING), T(NONE, SOS_PM_APC_STRING),
+         T(NONE, SOS_PM_APC_STRING), T(NONE, SOS_PM_APC_STRING),
+         T(NONE, SOS_PM_APC_STRING), T(NONE, SOS_PM_APC_STRING),
+         T(NONE, SOS_PM_APC_STRING), T(NONE, SOS_PM_APC_STRING),
+         T(NONE, SOS_PM_APC_STRING), T(NONE, SOS_PM_APC_STRING),
+         T(NONE, SOS_PM_APC_STRING)},
+};
+
+#undef T
+#undef S
+
+static void clear_sequence(AnsiParser *p) {
+  p->nparams = 0;
+  p->nintermediates = 0;
+  p->param_overflow = 0;
+  p->prefix = 0;
+  memset(p->params, 0, sizeof(p->params));
+}
+
+void ansi_init(AnsiParser *p) {
+  memset(p, 0, sizeof(*p));
+  p->state = ANSI_GROUND;
+}
+
+static void collect(AnsiParser *p, unsigned char byte) {
+  if (byte >= 0x3c && byte <= 0x3f) {
+    p->prefix = (char)byte;
+  } else if (p->nintermediates < ANSI_MAX_INTERMEDIATES) {
+    p->intermediates[p->nintermediates++] = (char)byte;
+  }
+}
+
+// Colon subparameters (38:5:208) are flattened into the same list as
+// semicolon parameters.
+static void param(AnsiParser *p, unsigned char byte) {
+  if (p->nparams == 0)
+    p->nparams = 1;
+  if (byte == ';' || byte == ':') {
+    if (p->nparams < ANSI_MAX_PARAMS)
+      p->nparams++;
+    else
+      p->param_overflow = 1;
+    return;
+  }
+  if (p->param_overflow)
+    return;
+  int *v = &p->params[p->nparams - 1];
+  *v = *v * 10 + (byte - '0');
+  if (*v > 65535)
+    *v = 65535;
+}
+
+static AnsiAction utf8_byte(AnsiParser *p, unsigned char byte) {
+  if (byte < 0xc0) {
+    if (p->utf8_need == 0) {
+      p->ch = 0xfffd;
+      return ANSI_PRINT;
+    }
+    p->utf8_cp = (p->utf8_cp << 6) | (byte & 0x3f);
+    if (--p->utf8_need > 0)
+      return ANSI_NONE;
+    p->ch = p->utf8_cp;
+    return ANSI_PRINT;
+  }
+  if (byte < 0xe0) {
+    p->utf8_cp = byte & 0x1f;
+    p->utf8_need = 1;
+  } else if (byte < 0xf0) {
+    p->utf8_cp = byte & 0x0f;
+    p->utf8_need = 2;
+  } else if (byte < 0xf8) {
+    p->utf8_cp = byte & 0x07;
+    p->utf8_need = 3;
+  } else {
+    p->utf8_need = 0;
+    p->ch = 0xfffd;
+    return ANSI_PRINT;
+  }
+  return ANSI_NONE;
+}
+
+AnsiAction ansi_step(AnsiParser *p, unsigned char byte) {
+  int cls = byte_class[byte];
+  uint8_t t = transitions[p->state][cls];
+  int action = t >> 4;
+  int next = t & 0x0f;
+  AnsiAction result = ANSI_NONE;
+
+  if (p->utf8_need && cls != C_HIGH)
+    p->utf8_need = 0; // truncated UTF-8 sequence
+
+  // Exit action of the state being left.
+  if (next != p->state && p->state == ANSI_OSC_STRING) {
+    p->osc[p->osc_len] = '\0';
+    result = ANSI_OSC_DISPATCH;
+  }
+
+  switch (action) {
+  case A_PRINT:
+    p->ch = byte;
+    result = ANSI_PRINT;
+    break;
+  case A_EXEC:
+    if (result == ANSI_NONE) {
+      p->ch = byte;
+      result = ANSI_EXECUTE;
+    }
+    break;
+  case A_COLLECT:
+    collect(p, byte);
+    break;
+  case A_PARAM:
+    param(p, byte);
+    break;
+  case A_ESC:
+    p->ch = byte;
+    result = ANSI_ESC_DISPATCH;
+    break;
+  case A_CSI:
+    p->ch = byte;
+    result = ANSI_CSI_DISPATCH;
+    break;
+  case A_OSC_PUT:
+    if (p->osc_len < ANSI_MAX_OSC - 1)
+      p->osc[p->osc_len++] = (char)byte;
+    break;
+  case A_UTF8:
+    result = utf8_byte(p, byte);
+    break;
+  }
+
+  // Entry action of the new state. ESC always restarts a sequence, even
+  // from within the escape state itself.
+  if (next != p->state || cls == C_ESC) {
+    switch (next) {
+    case ANSI_ESCAPE:
+    case ANSI_CSI_ENTRY:
+    case ANSI_DCS_ENTRY:
+      clear_sequence(p);
+      break;
+    case ANSI_OSC_STRING:
+      p->osc_len = 0;
+      break;
+    }
+  }
+  p->state = (uint8_t)next;
+  return result;
+}
+
+static const uint8_t cube_levels[6] = {0, 95, 135, 175, 215, 255};
+
+static int nearest_level(int v) {
+  int best = 0;
+  for (int i = 1; i < 6; i++) {
+    int d = v - cube_levels[i], bd = v - cube_levels[best];
+    if (d * d < bd * bd)
+      best = i;
+  }
+  return best;
+}
+
+int ansi_rgb_to_index(int r, int g, int b) {
+  return 16 + 36 * nearest_level(r) + 6 * nearest_level(g) +
+         nearest_level(b);
+}
+
+// Parses the colour after 38 or 48 starting at params[i]. Returns the
+// number of parameters consumed and stores the colour index in *color.
+static int extended_color(const int *params, int nparams, int i, int *color) {
+  if (i >= nparams)
+    return 0;
+  switch (params[i]) {
+  case 5:
+    if (i + 1 < nparams) {
+      *color = params[i + 1] & 0xff;
+      return 2;
+    }
+    return 1;
+  case 2:
+    if (i + 3 < nparams) {
+      *color = ansi_rgb_to_index(params[i + 1] & 0xff, params[i + 2] & 0xff,
+                                 params[i + 3] & 0xff);
+      return 4;
+    }
+    return nparams - i;
+  }
+  return 1;
+}
+
+void ansi_sgr(const int *params, int nparams, int *fg_color, int *bg_color,
+              int *attr) {
+  static const int reset = 0;
+  if (nparams == 0) {
+    params = &reset;
+    nparams = 1;
+  }
+  for (int i = 0; i < nparams; i++) {
+    int p = params[i];
+    switch (p) {
+    case 0:
+      *attr = 0;
+      *fg_color = ANSI_COLOR_WHITE;
+      *bg_color = ANSI_COLOR_BLACK;
+      break;
+    case 1: // Bold
+      *attr |= ATTR_BOLD;
+      break;
+    case 4:
+      *attr |= ATTR_UNDERLINE;
+      break;
+    case 7:
+      *attr |= ATTR_REVERSE;
+      break;
+    case 22:
+      *attr &= ~ATTR_BOLD;
+      break;
+    case 24:
+      *attr &= ~ATTR_UNDERLINE;
+      break;
+    case 27:
+      *attr &= ~ATTR_REVERSE;
+      break;
+    case 30 ... 37:
+      *fg_color = p - 30;
+      break;
+    case 38:
+      i += extended_color(params, nparams, i + 1, fg_color);
+      break;
+    case 39: // Reset foreground color
+      *fg_color = ANSI_COLOR_WHITE;
+      break;
+    case 40 ... 47:
+      *bg_color = p - 40;
+      break;
+    case 48:
+      i += extended_color(params, nparams, i + 1, bg_color);
+      break;
+    case 49: // Reset background color
+      *bg_color = ANSI_COLOR_BLACK;
+      break;
+    case 90 ... 97:
+      *fg_color = p - 90 + 8;
+      break;
+    case 100 ... 107:
+      *bg_color = p - 100 + 8;
+      break;
     }
   }
 }
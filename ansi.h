@@ -1,6 +1,8 @@
 #ifndef ANSI_H
 #define ANSI_H
 
+#include <stdint.h>
+
 #define ANSI_COLOR_BLACK   0
 #define ANSI_COLOR_RED     1
 #define ANSI_COLOR_GREEN   2
@@ -10,6 +12,81 @@
 #define ANSI_COLOR_CYAN    6
 #define ANSI_COLOR_WHITE   7
 
-void parse_ansi(const char *seq, int *fg_color, int *bg_color, int *attr);
+// Attribute bits set by SGR
+#define ATTR_BOLD      0x0001
+#define ATTR_UNDERLINE 0x0002
+#define ATTR_REVERSE   0x0004
+
+#define ANSI_MAX_PARAMS        16
+#define ANSI_MAX_INTERMEDIATES 2
+#define ANSI_MAX_OSC           256
+
+// States of the DEC/ANSI (VT500) parser, after Paul Williams' diagram.
+typedef enum {
+  ANSI_GROUND,
+  ANSI_ESCAPE,
+  ANSI_ESCAPE_INTERMEDIATE,
+  ANSI_CSI_ENTRY,
+  ANSI_CSI_PARAM,
+  ANSI_CSI_INTERMEDIATE,
+  ANSI_CSI_IGNORE,
+  ANSI_DCS_ENTRY,
+  ANSI_DCS_PARAM,
+  ANSI_DCS_INTERMEDIATE,
+  ANSI_DCS_PASSTHROUGH,
+  ANSI_DCS_IGNORE,
+  ANSI_OSC_STRING,
+  ANSI_SOS_PM_APC_STRING,
+  ANSI_STATE_COUNT
+} AnsiState;
+
+// What the caller has to do after feeding a byte. The relevant data is
+// left in the parser: ch for PRINT/EXECUTE and the final byte of a
+// dispatch, params/prefix/intermediates for ESC and CSI, osc for OSC.
+typedef enum {
+  ANSI_NONE,
+  ANSI_PRINT,
+  ANSI_EXECUTE,
+  ANSI_ESC_DISPATCH,
+  ANSI_CSI_DISPATCH,
+  ANSI_OSC_DISPATCH,
+} AnsiAction;
+
+// Parser state persists between calls, so a sequence split across two
+// reads is picked up where it left off.
+typedef struct {
+  uint8_t state;
+  uint8_t nparams;
+  uint8_t nintermediates;
+  uint8_t param_overflow;
+  char prefix; // CSI private marker: '?', '>', '<', '=' or 0
+  char intermediates[ANSI_MAX_INTERMEDIATES];
+  int params[ANSI_MAX_PARAMS];
+  uint32_t ch;
+  uint32_t utf8_cp;
+  int utf8_need;
+  int osc_len;
+  char osc[ANSI_MAX_OSC];
+} AnsiParser;
+
+void ansi_init(AnsiParser *p);
+AnsiAction ansi_step(AnsiParser *p, unsigned char byte);
+
+static inline int ansi_in_ground(const AnsiParser *p) {
+  return p->state == ANSI_GROUND && p->utf8_need == 0;
+}
+
+// Returns parameter i, or def if it is missing or zero.
+static inline int ansi_param(const AnsiParser *p, int i, int def) {
+  return (i < p->nparams && p->params[i] > 0) ? p->params[i] : def;
+}
+
+// Applies an SGR parameter list to the current colours and attributes.
+// Colours are indices into the 256-colour xterm palette.
+void ansi_sgr(const int *params, int nparams, int *fg_color, int *bg_color,
+              int *attr);
+
+// Maps a 24-bit colour to the nearest entry of the 6x6x6 colour cube.
+int ansi_rgb_to_index(int r, int g, int b);
 
-#endif // ANSI_H
\ No newline at end of file
+#endif // ANSI_H
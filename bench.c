@@ -0,0 +1,282 @@
+// Headless throughput benchmark for the terminal model. Replays a built-in
+// corpus through terminal_feed without a shell or an X display.
+//
+//   mt-bench [-n reps] [-r rows] [-c cols] [--json]
+//
+// Allocations are counted by wrapping the allocator at link time (see the
+// mt-bench rule in the Makefile).
+#include "scan.h"
+#include "scrollback.h"
+#include "terminal.h"
+#include <stdarg.h>
+#include <time.h>
+
+#define CORPUS_SIZE (4 << 20)
+#define DEFAULT_REPS 8
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t n, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+int __real_posix_memalign(void **ptr, size_t align, size_t size);
+
+static size_t allocs;
+
+void *__wrap_malloc(size_t size) {
+  allocs++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t n, size_t size) {
+  allocs++;
+  return __real_calloc(n, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  allocs++;
+  return __real_realloc(ptr, size);
+}
+
+int __wrap_posix_memalign(void **ptr, size_t align, size_t size) {
+  allocs++;
+  return __real_posix_memalign(ptr, align, size);
+}
+
+typedef struct {
+  char *data;
+  size_t len;
+} Buffer;
+
+static void append(Buffer *b, const char *s, size_t n) {
+  if (b->len + n > CORPUS_SIZE)
+    n = CORPUS_SIZE - b->len;
+  memcpy(b->data + b->len, s, n);
+  b->len += n;
+}
+
+static void appendf(Buffer *b, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void appendf(Buffer *b, const char *fmt, ...) {
+  char tmp[256];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(tmp, sizeof(tmp), fmt, ap);
+  va_end(ap);
+  if (n > 0)
+    append(b, tmp, (size_t)n < sizeof(tmp) ? (size_t)n : sizeof(tmp) - 1);
+}
+
+static int full(const Buffer *b) { return b->len + 256 > CORPUS_SIZE; }
+
+// Deterministic, so runs are comparable.
+static uint32_t rng = 1;
+static uint32_t next_rand(void) {
+  rng = rng * 1103515245u + 12345u;
+  return rng >> 16;
+}
+
+static const char *words[] = {
+    "lorem", "ipsum", "dolor", "sit", "amet", "consectetur",
+    "adipiscing", "elit", "sed", "do", "eiusmod", "tempor",
+    "incididunt", "ut", "labore", "et", "dolore", "magna"};
+#define NWORDS (sizeof(words) / sizeof(words[0]))
+
+static const char *word(void) { return words[next_rand() % NWORDS]; }
+
+// Lines that fit the screen, as from cat or a build log.
+static void gen_plain(Buffer *b, int cols) {
+  while (!full(b)) {
+    int len = 0;
+    for (;;) {
+      const char *w = word();
+      int n = strlen(w);
+      if (len + n + 1 >= cols)
+        break;
+      append(b, w, n);
+      append(b, " ", 1);
+      len += n + 1;
+    }
+    append(b, "\r\n", 2);
+  }
+}
+
+// A colour change on every word, as from ls --color or syntax highlighting.
+static void gen_sgr(Buffer *b, int cols) {
+  while (!full(b)) {
+    int len = 0;
+    for (;;) {
+      const char *w = word();
+      int n = strlen(w);
+      if (len + n + 1 >= cols)
+        break;
+      switch (next_rand() % 3) {
+      case 0:
+        appendf(b, "\033[%d;%dm", 30 + next_rand() % 8, 40 + next_rand() % 8);
+        break;
+      case 1:
+        appendf(b, "\033[1;38;5;%um", next_rand() % 256);
+        break;
+      default:
+        appendf(b, "\033[38;2;%u;%u;%um", next_rand() % 256, next_rand() % 256,
+                next_rand() % 256);
+        break;
+      }
+      append(b, w, n);
+      append(b, "\033[0m ", 5);
+      len += n + 1;
+    }
+    append(b, "\r\n", 2);
+  }
+}
+
+// Short writes at absolute positions, as from a full-screen TUI.
+static void gen_cursor(Buffer *b, int rows, int cols) {
+  while (!full(b)) {
+    appendf(b, "\033[%u;%uH%s", 1 + next_rand() % rows, 1 + next_rand() % cols,
+            word());
+    if (next_rand() % 16 == 0)
+      append(b, "\033[K", 3);
+  }
+}
+
+// Lines many times wider than the screen, relying on autowrap.
+static void gen_wrap(Buffer *b, int cols) {
+  while (!full(b)) {
+    int target = cols * 12 + next_rand() % cols;
+    for (int len = 0; len < target;) {
+      const char *w = word();
+      int n = strlen(w);
+      append(b, w, n);
+      append(b, " ", 1);
+      len += n + 1;
+    }
+    append(b, "\r\n", 2);
+  }
+}
+
+// Short lines inside a scroll region, plus reverse index and SU/SD.
+static void gen_scroll(Buffer *b, int rows) {
+  appendf(b, "\033[2;%dr\033[%d;1H", rows > 3 ? rows - 1 : rows, rows - 1);
+  while (!full(b)) {
+    appendf(b, "%s\r\n", word());
+    switch (next_rand() % 32) {
+    case 0:
+      append(b, "\033M", 2);
+      break;
+    case 1:
+      appendf(b, "\033[%uS", 1 + next_rand() % 4);
+      break;
+    case 2:
+      appendf(b, "\033[%uT", 1 + next_rand() % 4);
+      break;
+    }
+  }
+  append(b, "\033[r", 3);
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr, "usage: %s [-n reps] [-r rows] [-c cols] [--json]\n",
+          argv0);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+  int reps = DEFAULT_REPS, rows = TERM_ROWS, cols = TERM_COLS, json = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--json") == 0)
+      json = 1;
+    else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+      reps = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+      rows = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+      cols = atoi(argv[++i]);
+    else
+      usage(argv[0]);
+  }
+  if (reps < 1 || rows < 2 || cols < 2)
+    usage(argv[0]);
+
+  // No prompt: the model should only see the corpus. Fast-forward would
+  // skip most of the plain corpus, so it is off: the numbers are for the
+  // parser and the grid.
+  setenv("PS1", "", 1);
+  setenv("MT_FAST_FORWARD", "0", 1);
+  terminal_create(rows, cols);
+
+  static const char *names[] = {"plain", "sgr", "cursor", "wrap", "scroll"};
+  Buffer b = {malloc(CORPUS_SIZE), 0};
+  if (!b.data) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  if (!json)
+    printf("%-8s %10s %10s %10s %12s %10s %10s   (%dx%d, %d reps, scan %s)\n",
+           "corpus", "bytes", "MB/s", "ns/byte", "allocs/run", "sb KiB",
+           "res KiB", cols, rows, reps, scan_impl_name());
+
+  for (int k = 0; k < 5; k++) {
+    b.len = 0;
+    rng = 1;
+    switch (k) {
+    case 0:
+      gen_plain(&b, cols);
+      break;
+    case 1:
+      gen_sgr(&b, cols);
+      break;
+    case 2:
+      gen_cursor(&b, rows, cols);
+      break;
+    case 3:
+      gen_wrap(&b, cols);
+      break;
+    case 4:
+      gen_scroll(&b, rows);
+      break;
+    }
+
+    // One untimed pass warms the caches and the branch predictors.
+    terminal_feed(b.data, b.len);
+    terminal_write("\033c");
+    terminal_clear_damage();
+
+    size_t allocs_before = allocs;
+    double t0 = now_sec();
+    for (int r = 0; r < reps; r++)
+      terminal_feed(b.data, b.len);
+    double elapsed = now_sec() - t0;
+    double allocs_per_run = (double)(allocs - allocs_before) / reps;
+    // History left by the runs: logical size against memory actually held.
+    ScrollbackStats sb;
+    scrollback_stats(&sb);
+    terminal_write("\033c");
+    terminal_clear_damage();
+
+    double total = (double)b.len * reps;
+    double mbps = total / elapsed / 1e6;
+    double ns_per_byte = elapsed * 1e9 / total;
+    if (json)
+      printf("{\"corpus\":\"%s\",\"bytes\":%zu,\"reps\":%d,\"rows\":%d,"
+             "\"cols\":%d,\"scan\":\"%s\",\"mb_per_s\":%.2f,"
+             "\"ns_per_byte\":%.3f,\"allocs_per_run\":%.2f,"
+             "\"scrollback_logical\":%zu,\"scrollback_resident\":%zu,"
+             "\"scrollback_spilled\":%zu}\n",
+             names[k], b.len, reps, rows, cols, scan_impl_name(), mbps,
+             ns_per_byte, allocs_per_run, sb.logical, sb.resident, sb.spilled);
+    else
+      printf("%-8s %10zu %10.1f %10.3f %12.2f %10zu %10zu\n", names[k], b.len,
+             mbps, ns_per_byte, allocs_per_run, sb.logical >> 10,
+             sb.resident >> 10);
+  }
+
+  free(b.data);
+  terminal_cleanup();
+  return 0;
+}
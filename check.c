@@ -0,0 +1,200 @@
+// Checks the terminal model's shortcuts against the plain parse. Each
+// input is fed once with fast-forward on and once with MT_FAST_FORWARD=0,
+// in separate processes since the setting is read at startup, and the
+// screens, cursors and newest history lines must match.
+//
+//   mt-check [-n cases]
+#include "scrollback.h"
+#include "terminal.h"
+#include <stdarg.h>
+
+#define DEFAULT_CASES 300
+#define MAX_INPUT (64 << 10)
+#define MAX_DUMP (1 << 20)
+
+typedef struct {
+  int rows, cols;
+  const char *scrollback_lines;
+  char *setup, *text; // setup is fed first, then text in one call
+  size_t setup_len, text_len;
+} Case;
+
+typedef struct {
+  char *data;
+  size_t len;
+} Buffer;
+
+static void appendf(Buffer *b, size_t cap, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static void appendf(Buffer *b, size_t cap, const char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(b->data + b->len, cap - b->len, fmt, ap);
+  va_end(ap);
+  if (n > 0)
+    b->len += (size_t)n < cap - b->len ? (size_t)n : cap - b->len - 1;
+}
+
+// Feeds c in a child with fast-forward on or off and returns what it saw:
+// the cursor, every screen cell and the history, newest line first.
+static char *run(const Case *c, int fast_forward) {
+  int fds[2];
+  if (pipe(fds) < 0) {
+    perror("pipe");
+    exit(EXIT_FAILURE);
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    exit(EXIT_FAILURE);
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    setenv("MT_FAST_FORWARD", fast_forward ? "1" : "0", 1);
+    setenv("MT_SCROLLBACK_LINES", c->scrollback_lines, 1);
+    setenv("PS1", "", 1);
+    terminal_create(c->rows, c->cols);
+    terminal_feed(c->setup, c->setup_len);
+    terminal_feed(c->text, c->text_len);
+
+    Buffer out = {malloc(MAX_DUMP), 0};
+    appendf(&out, MAX_DUMP, "cursor %d %d\n", get_cursor_row(),
+            get_cursor_col());
+    for (int r = 0; r < c->rows; r++) {
+      const Cell *row = terminal_screen_row(r);
+      for (int col = 0; col < c->cols; col++)
+        appendf(&out, MAX_DUMP, "%x/%d/%d/%d ", row[col].ch, row[col].fg,
+                row[col].bg, row[col].attr);
+      appendf(&out, MAX_DUMP, "\n");
+    }
+    for (uint64_t seq = scrollback_end_seq(); seq > scrollback_first_seq();) {
+      size_t n;
+      const char *text = scrollback_text(--seq, &n);
+      appendf(&out, MAX_DUMP, "history %.*s\n", (int)n, text ? text : "");
+    }
+    if (write(fds[1], out.data, out.len) != (ssize_t)out.len)
+      _exit(EXIT_FAILURE);
+    _exit(0);
+  }
+  close(fds[1]);
+  char *data = malloc(MAX_DUMP);
+  size_t n = 0;
+  ssize_t r;
+  while (n < MAX_DUMP - 1 &&
+         (r = read(fds[0], data + n, MAX_DUMP - 1 - n)) > 0)
+    n += r;
+  close(fds[0]);
+  data[n] = '\0';
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "child failed\n");
+    exit(EXIT_FAILURE);
+  }
+  return data;
+}
+
+// The screens and cursors must be the same. The history may hold a
+// different number of old lines, as its chunks fill up differently, but
+// the lines both still have must match.
+static int same(const char *a, const char *b) {
+  const char *ha = strstr(a, "history "), *hb = strstr(b, "history ");
+  size_t sa = ha ? (size_t)(ha - a) : strlen(a);
+  size_t sb = hb ? (size_t)(hb - b) : strlen(b);
+  if (sa != sb || memcmp(a, b, sa) != 0)
+    return 0;
+  while (ha && hb) {
+    const char *ea = strchr(ha, '\n'), *eb = strchr(hb, '\n');
+    if (ea - ha != eb - hb || memcmp(ha, hb, ea - ha) != 0)
+      return 0;
+    ha = strstr(ea, "history ");
+    hb = strstr(eb, "history ");
+  }
+  return 1;
+}
+
+static int check(const char *name, const Case *c) {
+  char *on = run(c, 1), *off = run(c, 0);
+  int ok = same(on, off);
+  if (!ok) {
+    printf("FAIL %s (%dx%d, %s history lines)\n", name, c->rows, c->cols,
+           c->scrollback_lines);
+    printf("-- fast-forward on:\n%s-- off:\n%s", on, off);
+  }
+  free(on);
+  free(off);
+  return ok;
+}
+
+// Deterministic, so a failure can be replayed.
+static uint32_t rng = 1;
+static uint32_t next_rand(void) {
+  rng = rng * 1103515245u + 12345u;
+  return rng >> 16;
+}
+
+// Fills the screen with coloured rows, then puts the cursor anywhere.
+static void gen_setup(Case *c, Buffer *b) {
+  for (int r = 0; r < c->rows; r++) {
+    appendf(b, MAX_INPUT, "\033[%d;1H\033[3%um", r + 1, next_rand() % 8);
+    for (int col = 0; col < c->cols; col++)
+      appendf(b, MAX_INPUT, "%c", 'A' + r % 26);
+  }
+  appendf(b, MAX_INPUT, "\033[0m\033[%u;%uH", 1 + next_rand() % c->rows,
+          1 + next_rand() % c->cols);
+}
+
+// Plain text with enough line feeds that fast-forward may skip some.
+static void gen_text(Case *c, Buffer *b, int keep) {
+  int lines = keep + 1 + next_rand() % (2 * keep + 2);
+  for (int l = 0; l < lines; l++) {
+    int len = next_rand() % (2 * c->cols);
+    for (int i = 0; i < len; i++) {
+      uint32_t k = next_rand() % 40;
+      char ch = k == 0 ? '\r' : k == 1 ? '\t' : k == 2 ? '\b'
+                : k < 8 ? ' ' : 'a' + k % 26;
+      appendf(b, MAX_INPUT, "%c", ch);
+    }
+    appendf(b, MAX_INPUT, "\n");
+  }
+}
+
+int main(int argc, char **argv) {
+  int cases = DEFAULT_CASES;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      cases = atoi(argv[++i]);
+    } else {
+      fprintf(stderr, "usage: %s [-n cases]\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  int failed = 0;
+
+  // Text fed with the cursor at the top must not leave the rows below it.
+  static char fill[] = "AAAAAAAAAABBBBBBBBBBCCCCCCCCCCDDDDDDDDDD\033[H";
+  static char top[] = "1\n2\n3\n4\n5\n6\n";
+  Case c = {4, 10, "0", fill, top, sizeof(fill) - 1, sizeof(top) - 1};
+  failed += !check("cursor at the top", &c);
+
+  char setup[MAX_INPUT], text[MAX_INPUT];
+  static const char *history[] = {"0", "3", "50"};
+  for (int i = 0; i < cases; i++) {
+    c.rows = 2 + next_rand() % 8;
+    c.cols = 2 + next_rand() % 20;
+    c.scrollback_lines = history[next_rand() % 3];
+    Buffer s = {setup, 0}, t = {text, 0};
+    gen_setup(&c, &s);
+    gen_text(&c, &t, c.rows + atoi(c.scrollback_lines));
+    c.setup = s.data;
+    c.setup_len = s.len;
+    c.text = t.data;
+    c.text_len = t.len;
+    char name[32];
+    snprintf(name, sizeof(name), "random %d", i);
+    failed += !check(name, &c);
+  }
+  printf("%d of %d cases differ with fast-forward\n", failed, cases + 1);
+  return failed ? EXIT_FAILURE : 0;
+}
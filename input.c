@@ -1,4 +1,9 @@
 #include "input.h"
+#include "latency.h"
+#include "paste.h"
+#include "render.h"
+#include "search.h"
+#include "tabs.h"
 #include "terminal.h"
 #include <X11/Xutil.h>
 #include <X11/keysym.h>
@@ -11,12 +16,8 @@ extern Display *display;
 extern Window window;
 extern GC gc;
 
-#define MAX_INPUT_BUFFER_SIZE 1024
 #define CTRL_L 12
 
-static char input_buffer[MAX_INPUT_BUFFER_SIZE];
-static int input_pos = 0;
-
 typedef void (*CommandFunc)(char *args);
 
 typedef struct {
@@ -28,23 +29,13 @@ static void cmd_clear(char *args);
 
 static Command commands[] = {{"clear", cmd_clear}, {NULL, NULL}};
 
-void init_input() {
-  input_pos = 0;
-  memset(input_buffer, 0, sizeof(input_buffer));
-}
-
-void input_cleanup() {
-  input_pos = 0;
-  memset(input_buffer, 0, sizeof(input_buffer));
-}
-
 static void cmd_clear(char *args) { terminal_clear(); }
 
 static void process_command(const char *input) {
   if (!input || !*input)
     return;
 
-  char temp[MAX_INPUT_BUFFER_SIZE];
+  char temp[MAX_INPUT_LINE];
   strncpy(temp, input, sizeof(temp) - 1);
   temp[sizeof(temp) - 1] = '\0';
 
@@ -66,13 +57,244 @@ static void process_command(const char *input) {
 
 static int is_printable(char c) { return (c >= 32 && c <= 126); }
 
+// Keys with xterm escape sequences. Cursor keys switch to SS3 under
+// DECCKM; F1-F4 always use SS3 unless modified; the rest are CSI n ~.
+enum { KEY_CSI, KEY_CURSOR, KEY_SS3 };
+
+typedef struct {
+  KeySym sym;
+  int kind;
+  char final;
+  int code;
+} SpecialKey;
+
+static const SpecialKey special_keys[] = {
+    {XK_Up, KEY_CURSOR, 'A', 1},     {XK_Down, KEY_CURSOR, 'B', 1},
+    {XK_Right, KEY_CURSOR, 'C', 1},  {XK_Left, KEY_CURSOR, 'D', 1},
+    {XK_Home, KEY_CURSOR, 'H', 1},   {XK_End, KEY_CURSOR, 'F', 1},
+    {XK_KP_Up, KEY_CURSOR, 'A', 1},  {XK_KP_Down, KEY_CURSOR, 'B', 1},
+    {XK_KP_Right, KEY_CURSOR, 'C', 1}, {XK_KP_Left, KEY_CURSOR, 'D', 1},
+    {XK_KP_Home, KEY_CURSOR, 'H', 1}, {XK_KP_End, KEY_CURSOR, 'F', 1},
+    {XK_F1, KEY_SS3, 'P', 1},        {XK_F2, KEY_SS3, 'Q', 1},
+    {XK_F3, KEY_SS3, 'R', 1},        {XK_F4, KEY_SS3, 'S', 1},
+    {XK_Insert, KEY_CSI, '~', 2},    {XK_Delete, KEY_CSI, '~', 3},
+    {XK_KP_Insert, KEY_CSI, '~', 2}, {XK_KP_Delete, KEY_CSI, '~', 3},
+    {XK_Prior, KEY_CSI, '~', 5},     {XK_Next, KEY_CSI, '~', 6},
+    {XK_KP_Prior, KEY_CSI, '~', 5},  {XK_KP_Next, KEY_CSI, '~', 6},
+    {XK_F5, KEY_CSI, '~', 15},       {XK_F6, KEY_CSI, '~', 17},
+    {XK_F7, KEY_CSI, '~', 18},       {XK_F8, KEY_CSI, '~', 19},
+    {XK_F9, KEY_CSI, '~', 20},       {XK_F10, KEY_CSI, '~', 21},
+    {XK_F11, KEY_CSI, '~', 23},      {XK_F12, KEY_CSI, '~', 24},
+};
+
+// xterm modifier parameter: 1 + shift + 2*alt + 4*ctrl, or 0 if none.
+static int key_modifiers(unsigned int state) {
+  int m = 0;
+  if (state & ShiftMask)
+    m |= 1;
+  if (state & Mod1Mask)
+    m |= 2;
+  if (state & ControlMask)
+    m |= 4;
+  return m ? m + 1 : 0;
+}
+
+// Writes the escape sequence for a special key into out; returns its
+// length, or 0 if the key has none.
+static int encode_special(KeySym sym, unsigned int state, char *out,
+                          size_t size) {
+  if (sym == XK_ISO_Left_Tab)
+    return snprintf(out, size, "\033[Z");
+  int mod = key_modifiers(state);
+  for (size_t i = 0; i < sizeof(special_keys) / sizeof(special_keys[0]); i++) {
+    const SpecialKey *k = &special_keys[i];
+    if (k->sym != sym)
+      continue;
+    if (k->final == '~')
+      return mod ? snprintf(out, size, "\033[%d;%d~", k->code, mod)
+                 : snprintf(out, size, "\033[%d~", k->code);
+    if (mod)
+      return snprintf(out, size, "\033[1;%d%c", mod, k->final);
+    int ss3 = k->kind == KEY_SS3 ||
+              (k->kind == KEY_CURSOR && terminal_app_cursor_keys());
+    return snprintf(out, size, "\033%c%c", ss3 ? 'O' : '[', k->final);
+  }
+  return 0;
+}
+
+// Raw mode: translate the key and queue it for the shell. Ctrl+letter
+// comes out of XLookupString as a control character already; Alt
+// prefixes ESC.
+static void handle_raw_input(XKeyEvent *event) {
+  KeySym keysym;
+  char buffer[32];
+  int count = XLookupString(event, buffer, sizeof(buffer), &keysym, NULL);
+
+  char seq[32];
+  int n = encode_special(keysym, event->state, seq, sizeof(seq));
+  if (n > 0) {
+    latency_key_pressed();
+    terminal_send(seq, n);
+    return;
+  }
+  if (count <= 0)
+    return;
+  latency_key_pressed();
+  if (keysym == XK_BackSpace) {
+    buffer[0] = 0x7f;
+    count = 1;
+  }
+  if (event->state & Mod1Mask)
+    terminal_send("\033", 1);
+  terminal_send(buffer, count);
+}
+
+static void submit_line(void) {
+  InputLine *line = terminal_input_line();
+  line->text[line->len] = '\0';
+
+  if (line->len > 0) {
+    terminal_write("\n");
+    process_command(line->text);
+  }
+
+  line->len = 0;
+  memset(line->text, 0, sizeof(line->text));
+}
+
+static void insert_char(char c) {
+  InputLine *line = terminal_input_line();
+  if (line->len < MAX_INPUT_LINE - 1) {
+    line->text[line->len++] = c;
+    char text[2] = {c, '\0'};
+    terminal_write(text);
+  } else {
+    terminal_write("\a"); // Bell on overflow
+  }
+}
+
+void input_paste(const char *data, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    if (data[i] == '\n' || data[i] == '\r')
+      submit_line();
+    else if (is_printable(data[i]))
+      insert_char(data[i]);
+  }
+}
+
+static void show_search_status(void) {
+  char title[320];
+  search_status(title, sizeof(title));
+  render_set_title(title);
+}
+
+// Search mode: typing edits the query, Up and Down move to older and newer
+// matches, Return leaves the view at the match and Escape goes back to the
+// live screen.
+static void handle_search_input(XKeyEvent *event) {
+  KeySym keysym;
+  char buffer[32];
+  int count = XLookupString(event, buffer, sizeof(buffer), &keysym, NULL);
+  switch (keysym) {
+  case XK_Escape:
+    search_stop();
+    render_set_title(NULL);
+    terminal_scroll_view(-terminal_view_offset());
+    return;
+  case XK_Return:
+  case XK_KP_Enter:
+    search_stop();
+    render_set_title(NULL);
+    return;
+  case XK_Up:
+  case XK_KP_Up:
+    search_next(SEARCH_OLDER);
+    break;
+  case XK_Down:
+  case XK_KP_Down:
+    search_next(SEARCH_NEWER);
+    break;
+  case XK_BackSpace:
+    search_backspace();
+    break;
+  default:
+    if (count != 1 || !is_printable(buffer[0]) ||
+        (event->state & ControlMask))
+      return;
+    search_append(buffer, 1);
+    break;
+  }
+  show_search_status();
+}
+
 void handle_input(XKeyEvent *event) {
+  KeySym base = XLookupKeysym(event, 0);
+  // Shift+PgUp/PgDn scroll the view through the history by half a screen.
+  if ((base == XK_Prior || base == XK_Next) && (event->state & ShiftMask)) {
+    int page = get_terminal_rows() / 2 > 0 ? get_terminal_rows() / 2 : 1;
+    terminal_scroll_view(base == XK_Prior ? page : -page);
+    return;
+  }
+  // Ctrl+Shift+T opens a tab, Ctrl+Shift+W closes it, and Ctrl+PgUp/PgDn
+  // show the previous and next one.
+  int ctrl_shift = (event->state & (ShiftMask | ControlMask)) ==
+                   (ShiftMask | ControlMask);
+  if (ctrl_shift && (base == XK_t || base == XK_w)) {
+    if (base == XK_t)
+      tabs_new();
+    else
+      tabs_close();
+    return;
+  }
+  if ((base == XK_Prior || base == XK_Next) && (event->state & ControlMask)) {
+    tabs_step(base == XK_Prior ? -1 : 1);
+    return;
+  }
+  // Ctrl+Shift+S shows or hides the performance counters.
+  if (ctrl_shift && base == XK_s) {
+    render_toggle_stats();
+    return;
+  }
+  // Ctrl+Shift+F searches the history, or finds the next older match.
+  if (ctrl_shift && base == XK_f) {
+    if (search_active())
+      search_next(SEARCH_OLDER);
+    else
+      search_start();
+    show_search_status();
+    return;
+  }
+  if (search_active()) {
+    if (!IsModifierKey(base))
+      handle_search_input(event);
+    return;
+  }
+  // Anything else returns to the live screen.
+  if (!IsModifierKey(base))
+    terminal_scroll_view(-terminal_view_offset());
+
+  // Shift+Insert pastes the primary selection, Ctrl+Shift+V the clipboard.
+  if (base == XK_Insert && (event->state & ShiftMask)) {
+    paste_request(event->window, PASTE_PRIMARY, event->time);
+    return;
+  }
+  if (ctrl_shift && base == XK_v) {
+    paste_request(event->window, PASTE_CLIPBOARD, event->time);
+    return;
+  }
+
+  if (terminal_raw_mode()) {
+    handle_raw_input(event);
+    return;
+  }
+
   KeySym keysym;
   char buffer[32];
   int count = XLookupString(event, buffer, sizeof(buffer), &keysym, NULL);
 
   if (count <= 0)
     return;
+  latency_key_pressed();
 
   char c = buffer[0];
 
@@ -81,22 +303,14 @@ void handle_input(XKeyEvent *event) {
     return;
   }
   if (keysym == XK_Return) { // Enter key
-    input_buffer[input_pos] = '\0';
-
-    if (input_pos > 0) { 
-      terminal_write("\n");
-      process_command(input_buffer);
-    }
-
-    input_pos = 0;
-    memset(input_buffer, 0, sizeof(input_buffer));
+    submit_line();
     return;
   }
 
   if (keysym == XK_BackSpace) {
-    if (input_pos > 0) {
-      input_pos--;
-      input_buffer[input_pos] = '\0';
+    InputLine *line = terminal_input_line();
+    if (line->len > 0) {
+      line->text[--line->len] = '\0';
       int row = get_cursor_row();
       int col = get_cursor_col();
       if (col > 0) {
@@ -108,13 +322,6 @@ void handle_input(XKeyEvent *event) {
     return;
   }
 
-  if (is_printable(c)) {
-    if (input_pos < MAX_INPUT_BUFFER_SIZE - 1) {
-      input_buffer[input_pos++] = c;
-      char text[2] = {c, '\0'};
-      terminal_write(text);
-    } else {
-      terminal_write("\a"); // Bell on overflow
-    }
-  }
+  if (is_printable(c))
+    insert_char(c);
 }
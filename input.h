@@ -3,8 +3,8 @@
 
 #include <X11/Xlib.h>
 
-void init_input();
 void handle_input(XKeyEvent *event);
-void input_cleanup();
+// Line mode: pasted text is typed into the local line.
+void input_paste(const char *data, size_t len);
 
 #endif
@@ -0,0 +1,241 @@
+#include "latency.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// Values below 2^SUB_BITS get a bucket each; above that, each power of two
+// is split into 2^(SUB_BITS-1) linear buckets.
+#define SUB_BITS 5
+#define SUB_HALF (1 << (SUB_BITS - 1))
+#define LAT_BUCKETS ((1 << SUB_BITS) + (64 - SUB_BITS) * SUB_HALF)
+// Keypresses waiting for a frame; extra ones in the same frame are dropped.
+#define MAX_PENDING_KEYS 64
+
+typedef struct {
+  const char *name;
+  uint64_t count, sum, min, max;
+  uint64_t buckets[LAT_BUCKETS];
+} Histogram;
+
+static Histogram key_hist = {.name = "key-to-frame", .min = UINT64_MAX};
+static Histogram output_hist = {.name = "output-to-frame", .min = UINT64_MAX};
+
+static uint64_t pending_keys[MAX_PENDING_KEYS];
+static int npending_keys;
+static uint64_t pending_output; // oldest unshown output, 0 if none
+static int wait_for_echo;
+static uint64_t last_parse; // when output was last parsed
+
+// Startup profile. Marks come from the UI thread and, for the shell fork,
+// from a worker.
+#define MAX_MARKS 32
+static atomic_int profiling;
+static pthread_mutex_t marks_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+  const char *what;
+  uint64_t at;
+} marks[MAX_MARKS];
+static int nmarks;
+static uint64_t profile_start; // main
+static uint64_t exec_lead;     // exec to main, 0 if unknown
+static int frames_seen;
+static int shell_output_seen;
+
+uint64_t latency_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int bucket_index(uint64_t v) {
+  if (v < (1u << SUB_BITS))
+    return (int)v;
+  int e = 63 - __builtin_clzll(v);
+  int shift = e - (SUB_BITS - 1);
+  return (1 << SUB_BITS) + (e - SUB_BITS) * SUB_HALF +
+         (int)((v >> shift) - SUB_HALF);
+}
+
+// Largest value that falls into bucket i.
+static uint64_t bucket_value(int i) {
+  if (i < (1 << SUB_BITS))
+    return (uint64_t)i;
+  int e = (i - (1 << SUB_BITS)) / SUB_HALF + SUB_BITS;
+  uint64_t m = (i - (1 << SUB_BITS)) % SUB_HALF + SUB_HALF;
+  int shift = e - (SUB_BITS - 1);
+  return ((m + 1) << shift) - 1;
+}
+
+static void record(Histogram *h, uint64_t v) {
+  h->buckets[bucket_index(v)]++;
+  h->count++;
+  h->sum += v;
+  if (v < h->min)
+    h->min = v;
+  if (v > h->max)
+    h->max = v;
+}
+
+void latency_key_pressed(void) {
+  if (npending_keys < MAX_PENDING_KEYS)
+    pending_keys[npending_keys++] = latency_now();
+}
+
+void latency_wait_for_echo(int on) { wait_for_echo = on; }
+
+static void mark_at(const char *what, uint64_t at) {
+  pthread_mutex_lock(&marks_lock);
+  if (nmarks < MAX_MARKS) {
+    marks[nmarks].what = what;
+    marks[nmarks].at = at;
+    nmarks++;
+  }
+  pthread_mutex_unlock(&marks_lock);
+}
+
+void latency_mark(const char *what) {
+  if (atomic_load_explicit(&profiling, memory_order_relaxed))
+    mark_at(what, latency_now());
+}
+
+// How long before main the process was exec'd. The kernel keeps the start
+// time in clock ticks since boot, so this is only good to a tick.
+static uint64_t time_since_exec(void) {
+  char buf[1024];
+  FILE *f = fopen("/proc/self/stat", "r");
+  if (!f)
+    return 0;
+  size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+  fclose(f);
+  buf[n] = '\0';
+  // The command name may hold spaces; the fields after it do not.
+  char *p = strrchr(buf, ')');
+  unsigned long long ticks;
+  if (!p || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u "
+                           "%*u %*d %*d %*d %*d %*d %*d %llu",
+                   &ticks) != 1)
+    return 0;
+  struct timespec ts;
+  clock_gettime(CLOCK_BOOTTIME, &ts);
+  uint64_t boot = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+  uint64_t started = ticks * 1000000000ull / sysconf(_SC_CLK_TCK);
+  return boot > started ? boot - started : 0;
+}
+
+void latency_profile_startup(uint64_t main_start) {
+  uint64_t lead = time_since_exec();
+  uint64_t now = latency_now();
+  profile_start = main_start;
+  exec_lead = lead > now - main_start ? lead - (now - main_start) : 0;
+  atomic_store(&profiling, 1);
+  mark_at("main", main_start);
+}
+
+static void print_profile(void) {
+  pthread_mutex_lock(&marks_lock);
+  // Marks from the worker may be out of order.
+  for (int i = 1; i < nmarks; i++)
+    for (int j = i; j > 0 && marks[j].at < marks[j - 1].at; j--) {
+      const char *w = marks[j].what;
+      uint64_t at = marks[j].at;
+      marks[j] = marks[j - 1];
+      marks[j - 1].what = w;
+      marks[j - 1].at = at;
+    }
+  long tick_ms = 1000 / sysconf(_SC_CLK_TCK);
+  fprintf(stderr, "startup profile (ms since exec; exec to main is good to "
+                  "%ld ms):\n",
+          tick_ms);
+  fprintf(stderr, "  %9s %9s  %s\n", "at", "step", "done");
+  uint64_t prev = profile_start - exec_lead;
+  for (int i = 0; i < nmarks; i++) {
+    uint64_t at = marks[i].at - (profile_start - exec_lead);
+    fprintf(stderr, "  %9.2f %+9.2f  %s\n", at / 1e6,
+            (marks[i].at - prev) / 1e6, marks[i].what);
+    prev = marks[i].at;
+  }
+  nmarks = 0;
+  pthread_mutex_unlock(&marks_lock);
+}
+
+void latency_output_parsed(uint64_t ts) {
+  last_parse = latency_now();
+  if (!shell_output_seen && atomic_load(&profiling)) {
+    // ts is when the I/O thread read the bytes.
+    mark_at("first shell byte read", ts);
+    mark_at("first shell output parsed", last_parse);
+    shell_output_seen = 1;
+  }
+  if (ts && (!pending_output || ts < pending_output))
+    pending_output = ts;
+}
+
+void latency_frame_presented(void) {
+  if (atomic_load_explicit(&profiling, memory_order_relaxed)) {
+    if (frames_seen++ == 0)
+      latency_mark("first frame");
+    if (shell_output_seen) {
+      latency_mark("first shell output drawn");
+      atomic_store(&profiling, 0);
+      print_profile();
+    }
+  }
+  if (!npending_keys && !pending_output)
+    return;
+  uint64_t now = latency_now();
+  int kept = 0;
+  for (int i = 0; i < npending_keys; i++) {
+    if (wait_for_echo && last_parse < pending_keys[i])
+      pending_keys[kept++] = pending_keys[i];
+    else
+      record(&key_hist, now - pending_keys[i]);
+  }
+  npending_keys = kept;
+  if (pending_output) {
+    record(&output_hist, now - pending_output);
+    pending_output = 0;
+  }
+}
+
+static uint64_t percentile(const Histogram *h, double p) {
+  uint64_t want = (uint64_t)(h->count * p / 100.0 + 0.5), seen = 0;
+  if (want == 0)
+    want = 1;
+  for (int i = 0; i < LAT_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= want)
+      return bucket_value(i) < h->max ? bucket_value(i) : h->max;
+  }
+  return h->max;
+}
+
+static void dump_histogram(FILE *out, const Histogram *h) {
+  if (h->count == 0) {
+    fprintf(out, "%s: no samples\n", h->name);
+    return;
+  }
+  fprintf(out,
+          "%s: n=%llu min=%.3fms mean=%.3fms p50=%.3fms p90=%.3fms "
+          "p99=%.3fms p99.9=%.3fms max=%.3fms\n",
+          h->name, (unsigned long long)h->count, h->min / 1e6,
+          (double)h->sum / h->count / 1e6, percentile(h, 50) / 1e6,
+          percentile(h, 90) / 1e6, percentile(h, 99) / 1e6,
+          percentile(h, 99.9) / 1e6, h->max / 1e6);
+  fprintf(out, "  %12s %12s %10s\n", "<=ms", "percentile", "count");
+  uint64_t seen = 0;
+  for (int i = 0; i < LAT_BUCKETS; i++) {
+    if (!h->buckets[i])
+      continue;
+    seen += h->buckets[i];
+    fprintf(out, "  %12.3f %12.4f %10llu\n", bucket_value(i) / 1e6,
+            100.0 * seen / h->count, (unsigned long long)h->buckets[i]);
+  }
+}
+
+void latency_dump(FILE *out) {
+  dump_histogram(out, &key_hist);
+  dump_histogram(out, &output_hist);
+  fflush(out);
+}
@@ -0,0 +1,36 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Input and output latency, measured up to the frame that shows the
+// result. Samples go into log-linear (HDR-style) histograms: 16 buckets per
+// power of two, so any value is reported within about 6%.
+//
+// latency_dump() prints both histograms. main.c calls it on SIGUSR1, and
+// at exit when MT_LATENCY is set.
+
+uint64_t latency_now(void);
+
+// A KeyPress was handled; called from the UI thread.
+void latency_key_pressed(void);
+// PTY bytes that arrived at time ts (latency_now) were parsed.
+void latency_output_parsed(uint64_t ts);
+// In raw mode keys are echoed by the shell, so a key only completes at a
+// frame that shows output parsed after it.
+void latency_wait_for_echo(int on);
+// A frame was flushed to the server: completes every pending sample.
+void latency_frame_presented(void);
+
+void latency_dump(FILE *out);
+
+// Startup profile (--profile-startup). latency_mark notes that a step of
+// the startup is done; it may be called from any thread and does nothing
+// unless profiling. The first frame, the first shell output and the frame
+// that shows it are noted here, and once that frame is out the steps are
+// printed to stderr. main_start is when main was entered.
+void latency_profile_startup(uint64_t main_start);
+void latency_mark(const char *what);
+
+#endif // LATENCY_H
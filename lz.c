@@ -0,0 +1,172 @@
+#include "lz.h"
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 13
+// The last bytes are always literals, so matching never reads past the end.
+#define TAIL_LITERALS 5
+
+static inline uint32_t read32(const unsigned char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint64_t read64(const unsigned char *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t hash(uint32_t v) {
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Compares eight bytes at a time; the lowest differing byte of the XOR is
+// the first mismatch on a little-endian machine.
+static size_t match_length(const unsigned char *a, const unsigned char *b,
+                           size_t max) {
+  size_t len = 0;
+  while (len + 8 <= max) {
+    uint64_t diff = read64(a + len) ^ read64(b + len);
+    if (diff)
+      return len + (__builtin_ctzll(diff) >> 3);
+    len += 8;
+  }
+  while (len < max && a[len] == b[len])
+    len++;
+  return len;
+}
+
+// Lengths of 15 and more continue in extra bytes of up to 255 each.
+static unsigned char *put_length(unsigned char *op, size_t len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (unsigned char)len;
+  return op;
+}
+
+static unsigned char *put_sequence(unsigned char *op, const unsigned char *lit,
+                                   size_t nlit, size_t offset,
+                                   size_t match_len) {
+  size_t m = match_len ? match_len - MIN_MATCH : 0;
+  *op++ = (unsigned char)((nlit < 15 ? nlit : 15) << 4 | (m < 15 ? m : 15));
+  if (nlit >= 15)
+    op = put_length(op, nlit - 15);
+  memcpy(op, lit, nlit);
+  op += nlit;
+  if (match_len) {
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    if (m >= 15)
+      op = put_length(op, m - 15);
+  }
+  return op;
+}
+
+size_t lz_compress(const unsigned char *in, size_t n, unsigned char *out,
+                   size_t cap) {
+  uint16_t table[1 << HASH_BITS];
+  memset(table, 0, sizeof(table));
+  if (n > MAX_OFFSET + 1)
+    return 0;
+
+  unsigned char *op = out, *end = out + cap;
+  size_t anchor = 0, i = 1, misses = 0;
+  size_t limit = n > TAIL_LITERALS + MIN_MATCH ? n - TAIL_LITERALS : 0;
+  while (i + MIN_MATCH <= limit) {
+    uint32_t v = read32(in + i);
+    uint32_t h = hash(v);
+    size_t ref = table[h];
+    table[h] = (uint16_t)i;
+    if (ref >= i || read32(in + ref) != v) {
+      // Step faster through data that does not compress.
+      i += 1 + (misses++ >> 5);
+      continue;
+    }
+    misses = 0;
+    size_t len = MIN_MATCH + match_length(in + ref + MIN_MATCH,
+                                          in + i + MIN_MATCH,
+                                          limit - i - MIN_MATCH);
+    // Matches can often start earlier than the hash found them.
+    while (i > anchor && ref > 0 && in[ref - 1] == in[i - 1]) {
+      i--;
+      ref--;
+      len++;
+    }
+    size_t nlit = i - anchor;
+    // Worst case for this sequence: token, lengths, literals, offset.
+    if ((size_t)(end - op) < 1 + nlit / 255 + 1 + nlit + 2 + len / 255 + 1)
+      return 0;
+    op = put_sequence(op, in + anchor, nlit, i - ref, len);
+    i += len;
+    anchor = i;
+  }
+  size_t nlit = n - anchor;
+  if ((size_t)(end - op) < 1 + nlit / 255 + 1 + nlit)
+    return 0;
+  op = put_sequence(op, in + anchor, nlit, 0, 0);
+  return op - out;
+}
+
+static int get_length(const unsigned char **ip, const unsigned char *end,
+                      size_t *len) {
+  unsigned char b;
+  do {
+    if (*ip >= end)
+      return -1;
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+  return 0;
+}
+
+size_t lz_decompress(const unsigned char *in, size_t n, unsigned char *out,
+                     size_t cap) {
+  const unsigned char *ip = in, *iend = in + n;
+  unsigned char *op = out, *oend = out + cap;
+  while (ip < iend) {
+    unsigned char token = *ip++;
+    size_t nlit = token >> 4;
+    if (nlit == 15 && get_length(&ip, iend, &nlit) < 0)
+      return 0;
+    if (nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op))
+      return 0;
+    // Short runs are copied as a fixed 16 bytes when there is slack.
+    if (nlit <= 16 && iend - ip >= 16 && oend - op >= 16)
+      memcpy(op, ip, 16);
+    else
+      memcpy(op, ip, nlit);
+    ip += nlit;
+    op += nlit;
+    if (ip == iend)
+      break; // the last sequence has no match
+    if (iend - ip < 2)
+      return 0;
+    size_t offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    size_t len = token & 15;
+    if (len == 15 && get_length(&ip, iend, &len) < 0)
+      return 0;
+    len += MIN_MATCH;
+    if (offset == 0 || offset > (size_t)(op - out) ||
+        len > (size_t)(oend - op))
+      return 0;
+    const unsigned char *src = op - offset;
+    if (offset >= 16 && len <= 16 && oend - op >= 16) {
+      memcpy(op, src, 16);
+    } else if (offset >= len) {
+      memcpy(op, src, len);
+    } else {
+      // The source overlaps what is being written: a repeating pattern.
+      for (size_t k = 0; k < len; k++)
+        op[k] = src[k];
+    }
+    op += len;
+  }
+  return op - out;
+}
@@ -0,0 +1,19 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+// A small LZ77 codec in the style of LZ4: sequences of literals followed
+// by a back-reference (16-bit offset, match length >= 4). Fast enough to
+// run on a scrollback chunk without a visible pause. Inputs are limited to
+// 64 KiB.
+
+// Returns the compressed size, or 0 if it would not fit in cap.
+size_t lz_compress(const unsigned char *in, size_t n, unsigned char *out,
+                   size_t cap);
+// Returns the decompressed size, or 0 if the input is malformed or the
+// output would not fit in cap.
+size_t lz_decompress(const unsigned char *in, size_t n, unsigned char *out,
+                     size_t cap);
+
+#endif // LZ_H
@@ -1,10 +1,50 @@
+#include "latency.h"
 #include "render.h"
+#include "scrollback.h"
+#include "server.h"
+#include "stats.h"
+#include "terminal.h"
 #include <X11/Xlib.h>
+#include <errno.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
 
+// Sources multiplexed by the main loop, stored in epoll_event.data.u32.
+enum {
+  SRC_X,
+  SRC_PTY,
+  SRC_FRAME,
+  SRC_SIGNAL,
+  SRC_PTY_OUT,
+  SRC_RESIZE,
+  SRC_SERVER
+};
+
+#define MAX_EVENTS 8
+// Minimum time between two frames; MT_FRAME_MS overrides it.
+#define DEFAULT_FRAME_MS 16
+// While output is backlogged, frames only show progress this often; the
+// final state is drawn as soon as the backlog is gone.
+#define FLOOD_FRAME_MS 250
+// Shells a server keeps forked ahead of time; MT_PREFORK overrides it.
+#define DEFAULT_PREFORK 1
+
+// Frame scheduler. Work that changes the screen only sets frame_wanted;
+// frames are drawn at most once per frame_interval. The first frame after
+// an idle period is drawn right away so a lone keystroke is not delayed.
+static uint64_t frame_interval_ns;
+static uint64_t last_frame_ns;
+static int frame_wanted = 1;
+static int frame_timer_fd = -1;
+static int frame_timer_armed = 0;
+
 void handle_signal(int sig);
 
 int running = 1;
@@ -13,51 +53,264 @@ void handle_signal(int sig) {
   if (sig == SIGINT || sig == SIGTERM) {
     running = 0;
 
-    if (display) {
-      if (window) {
-        XDestroyWindow(display, window);
-      }
-      XCloseDisplay(display);
-    }
-
+    // render_cleanup closes the windows and the display.
     render_cleanup();
     exit(0);
   }
 }
 
-int main(void) {
+static void watch_fd(int epfd, int fd, uint32_t src) {
+  if (fd < 0)
+    return;
+  struct epoll_event ev = {.events = EPOLLIN, .data.u32 = src};
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    perror("epoll_ctl");
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void init_scheduler(void) {
+  const char *env = getenv("MT_FRAME_MS");
+  long ms = env ? strtol(env, NULL, 10) : DEFAULT_FRAME_MS;
+  if (ms < 0)
+    ms = 0;
+  frame_interval_ns = (uint64_t)ms * 1000000ull;
+  frame_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (frame_timer_fd < 0) {
+    perror("timerfd_create");
+    exit(1);
+  }
+}
+
+// Draws now if the last frame is at least one interval old, otherwise
+// arms the frame timer for when it will be.
+static void schedule_frame(void) {
+  uint64_t now = now_ns();
+  uint64_t interval = frame_interval_ns;
+  if (terminal_output_backlog() && interval < FLOOD_FRAME_MS * 1000000ull)
+    interval = FLOOD_FRAME_MS * 1000000ull;
+  if (now - last_frame_ns >= interval) {
+    render_frames();
+    last_frame_ns = now;
+    frame_wanted = 0;
+    return;
+  }
+  if (!frame_timer_armed) {
+    uint64_t due = last_frame_ns + interval;
+    struct itimerspec its = {
+        .it_value = {.tv_sec = due / 1000000000ull,
+                     .tv_nsec = due % 1000000000ull}};
+    timerfd_settime(frame_timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+    frame_timer_armed = 1;
+  }
+}
+
+// Input for the shell is written without blocking. While some is left
+// over, the PTY is watched for EPOLLOUT; the watch is dropped again once
+// the queue has drained, so an idle PTY does not wake the loop.
+static int pty_out_fd = -1;
+static uint32_t pty_out_events;
+
+static void flush_pty_writes(int epfd) {
+  terminal_flush_input();
+  int fd = terminal_get_pty_fd();
+  if (fd < 0) {
+    pty_out_fd = -1; // closing the fd removed it from the epoll set
+    return;
+  }
+  if (fd != pty_out_fd) {
+    // Another tab is shown; stop watching the last one's PTY.
+    if (pty_out_fd >= 0)
+      epoll_ctl(epfd, EPOLL_CTL_DEL, pty_out_fd, NULL);
+    struct epoll_event ev = {.events = 0, .data.u32 = SRC_PTY_OUT};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      perror("epoll_ctl");
+      return;
+    }
+    pty_out_fd = fd;
+    pty_out_events = 0;
+  }
+  uint32_t want = terminal_write_pending() ? EPOLLOUT : 0;
+  if (want != pty_out_events) {
+    struct epoll_event ev = {.events = want, .data.u32 = SRC_PTY_OUT};
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+      perror("epoll_ctl");
+    pty_out_events = want;
+  }
+}
+
+static void dump_stats(void) {
+  ScrollbackStats sb;
+  scrollback_stats(&sb);
+  fprintf(stderr,
+          "scrollback: lines=%d chunks=%d logical=%zu resident=%zu "
+          "spilled=%zu\n",
+          sb.lines, sb.chunks, sb.logical, sb.resident, sb.spilled);
+  latency_dump(stderr);
+}
+
+// SIGUSR1 dumps the latency histograms and scrollback memory use, and
+// SIGUSR2 prints the live counters as one line of JSON on stdout. Both are
+// blocked and read from a signalfd, so they are handled on the main loop
+// rather than in a handler.
+static int init_signalfd(void) {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  sigaddset(&set, SIGUSR2);
+  sigprocmask(SIG_BLOCK, &set, NULL);
+  int fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (fd < 0)
+    perror("signalfd");
+  return fd;
+}
+
+int main(int argc, char **argv) {
+  uint64_t main_start = latency_now();
+  int server = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--profile-startup") == 0) {
+      latency_profile_startup(main_start);
+    } else if (strcmp(argv[i], "-r") == 0) {
+      terminal_set_raw_mode(1);
+      latency_wait_for_echo(1);
+    } else if (strcmp(argv[i], "-s") == 0) {
+      server = 1;
+    } else if (strcmp(argv[i], "-c") == 0) {
+      // Without a server, this process shows the window itself.
+      int r = client_request_window();
+      if (r >= 0)
+        exit(r);
+    } else {
+      fprintf(stderr,
+              "usage: %s [-r] [-s | -c] [--profile-startup]\n"
+              "  -r  raw mode: keys go straight to the shell\n"
+              "  -s  server: stay resident and open windows for clients\n"
+              "  -c  client: ask the server for a new window\n"
+              "  --profile-startup  print where the time to the first "
+              "frame and\n"
+              "                     the first shell output went\n",
+              argv[0]);
+      exit(1);
+    }
+  }
   signal(SIGINT, handle_signal);
   signal(SIGTERM, handle_signal);
+  if (getenv("MT_LATENCY"))
+    atexit(dump_stats);
+  // Before any thread or child exists, so they inherit the mask.
+  int sigfd = init_signalfd();
   init_rendering();
+  long prefork = 0;
+  if (server) {
+    const char *env = getenv("MT_PREFORK");
+    prefork = env ? atol(env) : DEFAULT_PREFORK;
+  } else {
+    render_open_window();
+  }
+
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd < 0) {
+    perror("epoll_create1");
+    exit(1);
+  }
+  watch_fd(epfd, ConnectionNumber(display), SRC_X);
+  watch_fd(epfd, terminal_get_fd(), SRC_PTY);
+  init_scheduler();
+  watch_fd(epfd, frame_timer_fd, SRC_FRAME);
+  watch_fd(epfd, sigfd, SRC_SIGNAL);
+  watch_fd(epfd, render_get_resize_fd(), SRC_RESIZE);
+  if (server)
+    server_listen(epfd, SRC_SERVER);
+
+  latency_mark("main loop");
+
+  // The UI thread holds the lock of the tab it is handling only while it
+  // handles events and output. It lets go before it draws, forks warm
+  // shells or waits, so the workers can parse the visible tab meanwhile.
+  terminal_lock();
   while (running) {
-    while (XPending(display)) {
-      XEvent ev;
-      XNextEvent(display, &ev);
-      switch (ev.type) {
-      case Expose:
-        render_screen();
+    // Xlib may already hold events read off the socket, so drain its queue
+    // before blocking; XPending also flushes our outgoing requests. All
+    // events and output handled in one pass share a single frame.
+    if (process_events())
+      frame_wanted = 1;
+    // The stats overlay, if shown, is redrawn every second.
+    int timeout;
+    if (render_stats_due(&timeout))
+      frame_wanted = 1;
+    if (!server && render_window_count() == 0)
+      break;
+    // Keys, pastes and replies to queries from this pass.
+    flush_pty_writes(epfd);
+    terminal_unlock();
+    if (frame_wanted)
+      schedule_frame();
+    // Clients hear back once their window is up; only then is the next
+    // warm shell forked, so the fork does not delay a window.
+    if (server && server_reply() == 0)
+      terminal_prefork(prefork, TERM_ROWS, TERM_COLS);
+
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+    terminal_lock();
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      break;
+    }
+    for (int i = 0; i < n && running; i++) {
+      switch (events[i].data.u32) {
+      case SRC_X:
+        // Picked up by process_events at the top of the loop.
         break;
-      case KeyPress:
-        handle_key_event(&ev.xkey);
-        render_screen();
+      case SRC_PTY:
+        if (render_poll())
+          frame_wanted = 1;
+        if (!server && render_window_count() == 0)
+          running = 0; // the last shell exited
         break;
-      case ClientMessage:
-        running = 0;
+      case SRC_SERVER:
+        server_handle();
+        frame_wanted = 1;
         break;
-      case DestroyNotify:
-        running = 0;
+      case SRC_FRAME: {
+        uint64_t expirations;
+        if (read(frame_timer_fd, &expirations, sizeof(expirations)) < 0 &&
+            errno != EAGAIN)
+          perror("read frame timer");
+        frame_timer_armed = 0;
         break;
       }
+      case SRC_RESIZE:
+        if (render_handle_resize_timer())
+          frame_wanted = 1;
+        break;
+      case SRC_PTY_OUT:
+        // Writable again; flushed at the top of the loop.
+        break;
+      case SRC_SIGNAL: {
+        struct signalfd_siginfo si;
+        while (read(sigfd, &si, sizeof(si)) == sizeof(si)) {
+          if (si.ssi_signo == SIGUSR2)
+            stats_write_json(stdout);
+          else
+            dump_stats();
+        }
+        break;
+      }
+      }
     }
-    struct timespec ts = {0, 10000000L};
-    usleep(10000);
-  }
-  if (display) {
-    if (window) {
-      XDestroyWindow(display, window);
-    }
-    XCloseDisplay(display);
   }
+  close(epfd);
+  close(frame_timer_fd);
+  if (sigfd >= 0)
+    close(sigfd);
   render_cleanup();
   exit(0);
 }
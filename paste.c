@@ -0,0 +1,148 @@
+#include "paste.h"
+#include "input.h"
+#include "terminal.h"
+#include <X11/Xatom.h>
+#include <limits.h>
+
+static Display *dpy;
+// The window the pending request or transfer is for.
+static Window win;
+static Atom clipboard, utf8_string, incr, paste_property;
+// Target of the pending request: UTF8_STRING first, then STRING.
+static Atom requested_target = None;
+static int incr_active; // an INCR transfer is in progress
+
+void paste_init(Display *d) {
+  dpy = d;
+  // One round trip for all of them.
+  char *names[] = {"CLIPBOARD", "UTF8_STRING", "INCR", "MT_SELECTION"};
+  Atom atoms[4];
+  XInternAtoms(dpy, names, 4, False, atoms);
+  clipboard = atoms[0];
+  utf8_string = atoms[1];
+  incr = atoms[2];
+  paste_property = atoms[3];
+}
+
+void paste_request(Window w, int source, Time time) {
+  if (incr_active)
+    return; // one transfer at a time
+  win = w;
+  Atom selection = source == PASTE_CLIPBOARD ? clipboard : XA_PRIMARY;
+  requested_target = utf8_string;
+  XConvertSelection(dpy, selection, utf8_string, paste_property, win, time);
+}
+
+// In raw mode the paste goes to the shell, bracketed if it asked for
+// that; in line mode it is typed into the local line.
+static void begin_paste(void) {
+  if (terminal_raw_mode())
+    terminal_paste_begin();
+}
+
+static void end_paste(void) {
+  if (terminal_raw_mode())
+    terminal_paste_end();
+}
+
+static void deliver(const unsigned char *data, size_t len) {
+  if (terminal_raw_mode())
+    terminal_paste_data((const char *)data, len);
+  else
+    input_paste((const char *)data, len);
+}
+
+// UTF8_STRING is passed through; STRING is Latin-1 and gets converted.
+static void deliver_text(Atom type, const unsigned char *data, size_t len) {
+  if (type != XA_STRING) {
+    deliver(data, len);
+    return;
+  }
+  unsigned char chunk[4096];
+  size_t n = 0;
+  for (size_t i = 0; i < len; i++) {
+    if (n + 2 > sizeof(chunk)) {
+      deliver(chunk, n);
+      n = 0;
+    }
+    if (data[i] < 0x80) {
+      chunk[n++] = data[i];
+    } else {
+      chunk[n++] = 0xc0 | data[i] >> 6;
+      chunk[n++] = 0x80 | (data[i] & 0x3f);
+    }
+  }
+  deliver(chunk, n);
+}
+
+// Reads and deletes the paste property. Deleting it is also what asks an
+// INCR owner for the next piece.
+static Atom take_property(unsigned char **data, unsigned long *len) {
+  Atom type;
+  int format;
+  unsigned long after;
+  *data = NULL;
+  *len = 0;
+  if (XGetWindowProperty(dpy, win, paste_property, 0, LONG_MAX / 4, True,
+                         AnyPropertyType, &type, &format, len, &after,
+                         data) != Success)
+    return None;
+  if (format != 8)
+    *len = 0;
+  return type;
+}
+
+int paste_handle_event(const XEvent *ev) {
+  unsigned char *data;
+  unsigned long len;
+
+  if (ev->type == SelectionNotify) {
+    const XSelectionEvent *sel = &ev->xselection;
+    if (sel->requestor != win || requested_target == None)
+      return 0;
+    if (sel->property == None) {
+      // No UTF-8 from this owner; try plain STRING once.
+      if (requested_target == utf8_string) {
+        requested_target = XA_STRING;
+        XConvertSelection(dpy, sel->selection, XA_STRING, paste_property, win,
+                          sel->time);
+      } else {
+        requested_target = None;
+      }
+      return 1;
+    }
+    requested_target = None;
+    Atom type = take_property(&data, &len);
+    if (type == incr) {
+      // The owner now sends pieces, each as a new value of the property,
+      // and ends with an empty one.
+      incr_active = 1;
+      begin_paste();
+    } else if (type != None) {
+      begin_paste();
+      deliver_text(type, data, len);
+      end_paste();
+    }
+    if (data)
+      XFree(data);
+    return 1;
+  }
+
+  if (ev->type == PropertyNotify) {
+    const XPropertyEvent *prop = &ev->xproperty;
+    if (!incr_active || prop->window != win ||
+        prop->atom != paste_property || prop->state != PropertyNewValue)
+      return 0;
+    Atom type = take_property(&data, &len);
+    if (len == 0) {
+      end_paste();
+      incr_active = 0;
+    } else {
+      deliver_text(type, data, len);
+    }
+    if (data)
+      XFree(data);
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,18 @@
+#ifndef PASTE_H
+#define PASTE_H
+
+#include <X11/Xlib.h>
+
+// Pasting from X selections. paste_request asks the owner of a selection
+// for its text; the answer arrives through paste_handle_event, in several
+// pieces if the owner uses the INCR protocol for large transfers. The
+// text goes to the current session, so events must be handled with the
+// requesting window's session current.
+enum { PASTE_PRIMARY, PASTE_CLIPBOARD };
+
+void paste_init(Display *dpy);
+void paste_request(Window win, int source, Time time);
+// Returns 1 if ev was part of a paste.
+int paste_handle_event(const XEvent *ev);
+
+#endif // PASTE_H
@@ -0,0 +1,359 @@
+#include "raster.h"
+#include "ansi.h"
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#define GLYPHS 256
+// Tile cache slots (power of two). The cache is flushed when 3/4 full.
+#define TILE_CACHE_BITS 12
+#define TILE_CACHE_SIZE (1 << TILE_CACHE_BITS)
+#define TILE_KEY_EMPTY 0xffffffffu
+
+static Display *dpy;
+static Visual *visual;
+static int depth;
+static int cell_w, cell_h, font_ascent;
+static const unsigned long *palette;
+static uint32_t grid_px;
+
+// One byte per pixel, nonzero where the glyph has ink.
+static uint8_t *glyph_masks;
+// Composited cell tiles and their keys, open addressing.
+static uint32_t *tiles;
+static uint32_t *tile_keys;
+static int tiles_used;
+
+static int use_shm;
+static int completion_type;
+
+// The framebuffer of one window.
+struct RasterSurface {
+  Window win;
+  XImage *fb;
+  XShmSegmentInfo shm;
+  int shm_attached;
+  int shm_busy;
+  int fb_w, fb_h;
+};
+
+static RasterSurface *surf;
+
+static int rasterise_glyphs(XFontStruct *font) {
+  int w = GLYPHS * cell_w;
+  Pixmap pm = XCreatePixmap(dpy, DefaultRootWindow(dpy), w, cell_h, 1);
+  GC g = XCreateGC(dpy, pm, 0, NULL);
+  XSetForeground(dpy, g, 0);
+  XFillRectangle(dpy, pm, g, 0, 0, w, cell_h);
+  XSetForeground(dpy, g, 1);
+  XSetFont(dpy, g, font->fid);
+  for (int i = 32; i < GLYPHS; i++) {
+    if (i >= 127 && i < 160)
+      continue;
+    char c = (char)i;
+    XDrawString(dpy, pm, g, i * cell_w, font->ascent, &c, 1);
+  }
+  // One round trip for the whole font.
+  XImage *img = XGetImage(dpy, pm, 0, 0, w, cell_h, 1, XYPixmap);
+  XFreeGC(dpy, g);
+  XFreePixmap(dpy, pm);
+  if (!img)
+    return -1;
+
+  glyph_masks = calloc((size_t)GLYPHS * cell_w * cell_h, 1);
+  if (!glyph_masks) {
+    XDestroyImage(img);
+    return -1;
+  }
+  for (int i = 0; i < GLYPHS; i++) {
+    uint8_t *mask = glyph_masks + (size_t)i * cell_w * cell_h;
+    for (int y = 0; y < cell_h; y++)
+      for (int x = 0; x < cell_w; x++)
+        mask[y * cell_w + x] = XGetPixel(img, i * cell_w + x, y) != 0;
+  }
+  XDestroyImage(img);
+  return 0;
+}
+
+static void build_tile(uint32_t *tile, uint32_t glyph, int fg, int bg,
+                       int attr) {
+  const uint8_t *mask = glyph_masks + (size_t)glyph * cell_w * cell_h;
+  uint32_t fg_px = (uint32_t)palette[fg], bg_px = (uint32_t)palette[bg];
+  int underline_y = font_ascent + 1 < cell_h ? font_ascent + 1 : cell_h - 1;
+  for (int y = 0; y < cell_h; y++) {
+    for (int x = 0; x < cell_w; x++) {
+      int on = mask[y * cell_w + x];
+      // Bold is drawn by smearing the glyph one pixel to the right.
+      if ((attr & ATTR_BOLD) && x > 0)
+        on |= mask[y * cell_w + x - 1];
+      if ((attr & ATTR_UNDERLINE) && y == underline_y)
+        on = 1;
+      // Column 0 holds the grid line, which sits under the glyph.
+      uint32_t px = x == 0 ? grid_px : bg_px;
+      tile[y * cell_w + x] = on ? fg_px : px;
+    }
+  }
+}
+
+static const uint32_t *tile_for(uint32_t ch, int fg, int bg, int attr) {
+  uint32_t glyph = ch < GLYPHS ? ch : '?';
+  attr &= ATTR_BOLD | ATTR_UNDERLINE;
+  uint32_t key = glyph | (uint32_t)(fg & 0xff) << 8 |
+                 (uint32_t)(bg & 0xff) << 16 | (uint32_t)attr << 24;
+  size_t tile_px = (size_t)cell_w * cell_h;
+  uint32_t slot = (key * 2654435761u) >> (32 - TILE_CACHE_BITS);
+  while (tile_keys[slot] != TILE_KEY_EMPTY) {
+    if (tile_keys[slot] == key)
+      return tiles + slot * tile_px;
+    slot = (slot + 1) & (TILE_CACHE_SIZE - 1);
+  }
+  if (tiles_used >= TILE_CACHE_SIZE * 3 / 4) {
+    memset(tile_keys, 0xff, TILE_CACHE_SIZE * sizeof(uint32_t));
+    tiles_used = 0;
+    slot = (key * 2654435761u) >> (32 - TILE_CACHE_BITS);
+  }
+  tile_keys[slot] = key;
+  tiles_used++;
+  build_tile(tiles + slot * tile_px, glyph, fg, bg, attr);
+  return tiles + slot * tile_px;
+}
+
+static int shm_error;
+
+static int shm_error_handler(Display *d, XErrorEvent *e) {
+  (void)d;
+  (void)e;
+  shm_error = 1;
+  return 0;
+}
+
+// XShmAttach fails asynchronously on a remote display, so check for the
+// error before committing to shared memory.
+static int shm_attach_checked(void) {
+  shm_error = 0;
+  XErrorHandler old = XSetErrorHandler(shm_error_handler);
+  XShmAttach(dpy, &surf->shm);
+  XSync(dpy, False);
+  XSetErrorHandler(old);
+  return !shm_error;
+}
+
+static void destroy_fb(void) {
+  if (!surf->fb)
+    return;
+  raster_wait_idle();
+  if (surf->shm_attached) {
+    XShmDetach(dpy, &surf->shm);
+    XSync(dpy, False);
+    shmdt(surf->shm.shmaddr);
+    surf->fb->data = NULL;
+    surf->shm_attached = 0;
+  }
+  XDestroyImage(surf->fb);
+  surf->fb = NULL;
+}
+
+static int create_shm_fb(int w, int h) {
+  surf->fb =
+      XShmCreateImage(dpy, visual, depth, ZPixmap, NULL, &surf->shm, w, h);
+  if (!surf->fb)
+    return -1;
+  surf->shm.shmid = shmget(
+      IPC_PRIVATE, (size_t)surf->fb->bytes_per_line * h, IPC_CREAT | 0600);
+  if (surf->shm.shmid < 0)
+    goto fail;
+  surf->shm.shmaddr = surf->fb->data = shmat(surf->shm.shmid, NULL, 0);
+  surf->shm.readOnly = False;
+  if (surf->shm.shmaddr == (char *)-1 || !shm_attach_checked()) {
+    if (surf->shm.shmaddr != (char *)-1)
+      shmdt(surf->shm.shmaddr);
+    shmctl(surf->shm.shmid, IPC_RMID, NULL);
+    goto fail;
+  }
+  // Removed now so the segment goes away with us however we exit.
+  shmctl(surf->shm.shmid, IPC_RMID, NULL);
+  surf->shm_attached = 1;
+  return 0;
+fail:
+  surf->fb->data = NULL;
+  XDestroyImage(surf->fb);
+  surf->fb = NULL;
+  return -1;
+}
+
+int raster_resize(int w, int h) {
+  destroy_fb();
+  if (use_shm && create_shm_fb(w, h) < 0) {
+    fprintf(stderr, "MIT-SHM unavailable, falling back to XPutImage\n");
+    use_shm = 0;
+  }
+  if (!surf->fb) {
+    surf->fb =
+        XCreateImage(dpy, visual, depth, ZPixmap, 0, NULL, w, h, 32, 0);
+    if (!surf->fb)
+      return -1;
+    surf->fb->data = malloc((size_t)surf->fb->bytes_per_line * h);
+    if (!surf->fb->data) {
+      XDestroyImage(surf->fb);
+      surf->fb = NULL;
+      return -1;
+    }
+  }
+  if (surf->fb->bits_per_pixel != 32) {
+    destroy_fb();
+    return -1;
+  }
+  surf->fb_w = w;
+  surf->fb_h = h;
+  memset(surf->fb->data, 0, (size_t)surf->fb->bytes_per_line * h);
+  return 0;
+}
+
+int raster_init(Display *d, XFontStruct *font, int cw, int ch,
+                const unsigned long *pal, unsigned long grid_pixel) {
+  dpy = d;
+  int screen = DefaultScreen(dpy);
+  visual = DefaultVisual(dpy, screen);
+  depth = DefaultDepth(dpy, screen);
+  // Palette entries are 0xRRGGBB, so only plain 24-bit TrueColor works.
+  if (visual->class != TrueColor || (depth != 24 && depth != 32) ||
+      visual->red_mask != 0xff0000 || visual->green_mask != 0xff00 ||
+      visual->blue_mask != 0xff)
+    return -1;
+
+  cell_w = cw;
+  cell_h = ch;
+  font_ascent = font->ascent;
+  palette = pal;
+  grid_px = (uint32_t)grid_pixel;
+  if (rasterise_glyphs(font) < 0)
+    return -1;
+
+  tiles = malloc((size_t)TILE_CACHE_SIZE * cell_w * cell_h * sizeof(uint32_t));
+  tile_keys = malloc(TILE_CACHE_SIZE * sizeof(uint32_t));
+  if (!tiles || !tile_keys) {
+    raster_cleanup();
+    return -1;
+  }
+  memset(tile_keys, 0xff, TILE_CACHE_SIZE * sizeof(uint32_t));
+  tiles_used = 0;
+
+  const char *env = getenv("MT_SHM");
+  use_shm = XShmQueryExtension(dpy) && !(env && strcmp(env, "0") == 0);
+  if (use_shm)
+    completion_type = XShmGetEventBase(dpy) + ShmCompletion;
+  return 0;
+}
+
+void raster_cleanup(void) {
+  free(glyph_masks);
+  free(tiles);
+  free(tile_keys);
+  glyph_masks = NULL;
+  tiles = NULL;
+  tile_keys = NULL;
+}
+
+RasterSurface *raster_surface_create(Window win) {
+  RasterSurface *s = calloc(1, sizeof(*s));
+  if (!s)
+    return NULL;
+  s->win = win;
+  surf = s;
+  return s;
+}
+
+void raster_surface_select(RasterSurface *s) { surf = s; }
+
+void raster_surface_free(void) {
+  if (!surf)
+    return;
+  destroy_fb();
+  free(surf);
+  surf = NULL;
+}
+
+void raster_cell(int x, int y, uint32_t ch, int fg, int bg, int attr) {
+  if (x < 0 || y < 0 || x + cell_w > surf->fb_w || y + cell_h > surf->fb_h)
+    return;
+  const uint32_t *tile = tile_for(ch, fg, bg, attr);
+  char *dst =
+      surf->fb->data + (size_t)y * surf->fb->bytes_per_line + (size_t)x * 4;
+  for (int row = 0; row < cell_h; row++) {
+    memcpy(dst, tile + row * cell_w, cell_w * sizeof(uint32_t));
+    dst += surf->fb->bytes_per_line;
+  }
+}
+
+void raster_fill(int x, int y, int w, int h, unsigned long pixel) {
+  if (x < 0) {
+    w += x;
+    x = 0;
+  }
+  if (y < 0) {
+    h += y;
+    y = 0;
+  }
+  if (x + w > surf->fb_w)
+    w = surf->fb_w - x;
+  if (y + h > surf->fb_h)
+    h = surf->fb_h - y;
+  for (int row = y; row < y + h; row++) {
+    uint32_t *dst = (uint32_t *)(surf->fb->data +
+                                 (size_t)row * surf->fb->bytes_per_line);
+    for (int col = x; col < x + w; col++)
+      dst[col] = (uint32_t)pixel;
+  }
+}
+
+void raster_wait_idle(void) {
+  if (!surf->shm_busy)
+    return;
+  XEvent ev;
+  if (!XCheckTypedWindowEvent(dpy, surf->win, completion_type, &ev)) {
+    XSync(dpy, False);
+    XCheckTypedWindowEvent(dpy, surf->win, completion_type, &ev);
+  }
+  surf->shm_busy = 0;
+}
+
+void raster_present(GC gc, const XRectangle *rects, int n) {
+  if (n <= 0 || !surf->fb)
+    return;
+  if (use_shm) {
+    // Shared memory makes the copy cheap, so send one bounding box.
+    int x0 = rects[0].x, y0 = rects[0].y;
+    int x1 = x0 + rects[0].width, y1 = y0 + rects[0].height;
+    for (int i = 1; i < n; i++) {
+      if (rects[i].x < x0)
+        x0 = rects[i].x;
+      if (rects[i].y < y0)
+        y0 = rects[i].y;
+      if (rects[i].x + rects[i].width > x1)
+        x1 = rects[i].x + rects[i].width;
+      if (rects[i].y + rects[i].height > y1)
+        y1 = rects[i].y + rects[i].height;
+    }
+    XShmPutImage(dpy, surf->win, gc, surf->fb, x0, y0, x0, y0, x1 - x0,
+                 y1 - y0, True);
+    surf->shm_busy = 1;
+  } else {
+    for (int i = 0; i < n; i++)
+      XPutImage(dpy, surf->win, gc, surf->fb, rects[i].x, rects[i].y,
+                rects[i].x, rects[i].y, rects[i].width, rects[i].height);
+  }
+}
+
+int raster_handle_event(const XEvent *ev) {
+  if (!use_shm || ev->type != completion_type)
+    return 0;
+  if (surf && ((const XShmCompletionEvent *)ev)->drawable == surf->win)
+    surf->shm_busy = 0;
+  return 1;
+}
+
+int raster_uses_shm(void) { return use_shm; }
@@ -0,0 +1,44 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+#include <X11/Xlib.h>
+#include <stdint.h>
+
+// Client-side rendering backend. Glyphs of the core font are rasterised
+// once into a mask atlas; each glyph/colour/attribute combination is then
+// composited once into a cached cell tile, and frames are built by copying
+// tiles into a framebuffer that is shown with XShmPutImage, or XPutImage
+// when shared memory is unavailable (e.g. a remote display).
+//
+// The glyph atlas and the tile cache are shared by all windows; each
+// window has its own framebuffer, a RasterSurface. raster_resize, the
+// drawing calls and raster_present act on the selected surface.
+typedef struct RasterSurface RasterSurface;
+
+// Returns 0 if the backend can be used on this display. The palette maps
+// colour indices to pixel values; grid_pixel is baked into the first
+// column of each cell like the core renderer's grid lines.
+int raster_init(Display *dpy, XFontStruct *font, int cell_w, int cell_h,
+                const unsigned long *palette, unsigned long grid_pixel);
+void raster_cleanup(void);
+
+// Creates a surface for win and selects it; NULL if out of memory.
+RasterSurface *raster_surface_create(Window win);
+void raster_surface_select(RasterSurface *s);
+// Frees the selected surface and its framebuffer.
+void raster_surface_free(void);
+int raster_resize(int w, int h);
+
+void raster_cell(int x, int y, uint32_t ch, int fg, int bg, int attr);
+void raster_fill(int x, int y, int w, int h, unsigned long pixel);
+
+// Blocks until the server has finished reading the previous frame, so
+// the framebuffer can be written without tearing.
+void raster_wait_idle(void);
+// Shows the given framebuffer rectangles in the window.
+void raster_present(GC gc, const XRectangle *rects, int n);
+// Consumes MIT-SHM completion events; returns 1 if ev was one.
+int raster_handle_event(const XEvent *ev);
+int raster_uses_shm(void);
+
+#endif // RASTER_H
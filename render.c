@@ -1,6 +1,12 @@
 #include "render.h"
 #include "ansi.h"
 #include "input.h"
+#include "latency.h"
+#include "paste.h"
+#include "raster.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "tabs.h"
 #include "terminal.h"
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
@@ -10,36 +16,203 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 
 #define PADDING 5
 #define GRID_COLOR 0x333333
 #define BORDER_WIDTH 1
 #define DEBUG_GRID false
+#define WHEEL_LINES 3
+#define DEFAULT_TITLE "Minimal Terminal"
+// Quiet time after the last ConfigureNotify before a new size is applied;
+// MT_RESIZE_SETTLE_MS overrides it, 0 applies every size at once.
+#define DEFAULT_RESIZE_SETTLE_MS 50
+// Frames whose render time and X requests are kept for the counters.
+#define RENDER_SAMPLES 256
+// The stats overlay: redrawn this often while shown, in these colours.
+#define STATS_REFRESH_MS 1000
+#define STATS_MAX_LINES 8
+#define STATS_FG 255
+#define STATS_BG 236
 
 Display *display;
 Window window;
 GC gc;
-static Pixmap backBuffer;
 static Atom wmDelete;
 
+// One top-level window. The display, the font, the palette, the glyph and
+// tile caches, the GC and the frame batches are shared by all of them.
+typedef struct {
+  unsigned id;
+  Window xwin;
+  Tabs *tabs;
+  Snapshot *snapshot;
+  Pixmap backBuffer;
+  Pixmap gridLayer;
+  Pixmap bgMask;
+  GC bgGC;
+
+  // Set when the whole window must be redrawn (expose, resize); otherwise
+  // render_screen only repaints the damage carried by the snapshot.
+  int full_repaint;
+  int drawn_cursor_row, drawn_cursor_col;
+
+  // Set when frames are composited client-side by raster.c instead of
+  // being drawn with core X requests. MT_RENDER=core forces the core
+  // backend.
+  int use_raster;
+  RasterSurface *surface;
+  int raster_w, raster_h;
+
+  int cols, rows;
+  // Window size the layers and the terminal were last fitted to.
+  int win_w, win_h;
+  // Dragging a window edge reports a stream of sizes. Each one only
+  // records the target and restarts the settle timer; the pixmaps, the
+  // grid and the PTY winsize follow once, when the size has stopped
+  // changing.
+  int pending_w, pending_h;
+
+  int frame_wanted;
+  // A window that is unmapped (iconified) or fully covered gets no frames
+  // and no pixmap work; its tabs keep parsing, and it is repainted in full
+  // once it can be seen again.
+  int mapped, obscured;
+  int exposed;
+  long frames; // drawn since the window was first exposed
+} Win;
+
+static Win **wins;
+static int nwins, wins_cap;
+static unsigned next_win_id = 1;
+// The window being handled; its visible tab is the current session.
+static Win *cur;
+
+// The snapshot being drawn; frames never read the terminal itself.
+static const Snapshot *snap;
+
+// Counters for render_counters. A frame request that finds a frame
+// already wanted is merged into it; that is a frame skipped.
+static long frames_drawn, frames_merged;
+static uint32_t render_ns[RENDER_SAMPLES];
+static uint32_t render_requests[RENDER_SAMPLES];
+static int nrender_samples;
+
+// The stats overlay, shown in the top right corner of every window.
+static int show_stats;
+static uint64_t stats_due;
+static char stats_lines[STATS_MAX_LINES][STATS_OVERLAY_COLS + 1];
+static int nstats_lines;
+
+// Whether the image backend can be used on this display; -1 until it is
+// tried, which is once the first window is mapped, so rasterising the
+// glyphs overlaps with the window manager putting the window up.
+static int raster_ok = -1;
+
 static XFontStruct *font;
 static int charW, charH;
-static int cols, rows;
+// One timer serves all windows; when it fires, each takes its last size.
+static int resize_timer_fd = -1;
+static long resize_settle_ms = DEFAULT_RESIZE_SETTLE_MS;
 static unsigned long colors[8] = {COLOR_BLACK,  COLOR_RED,  COLOR_GREEN,
                                   COLOR_YELLOW, COLOR_BLUE, COLOR_MAGENTA,
                                   COLOR_CYAN,   COLOR_WHITE};
+static unsigned long bright_colors[8] = {0x555555, 0xFF5555, 0x55FF55,
+                                         0xFFFF55, 0x5555FF, 0xFF55FF,
+                                         0x55FFFF, 0xFFFFFF};
+// xterm 256-colour palette: the 16 base colours, a 6x6x6 cube and a
+// 24-step grey ramp.
+static unsigned long palette[256];
+
+static void init_palette() {
+  static const int levels[6] = {0, 95, 135, 175, 215, 255};
+  for (int i = 0; i < 8; i++) {
+    palette[i] = colors[i];
+    palette[i + 8] = bright_colors[i];
+  }
+  for (int i = 0; i < 216; i++) {
+    int r = levels[i / 36], g = levels[(i / 6) % 6], b = levels[i % 6];
+    palette[16 + i] = (r << 16) | (g << 8) | b;
+  }
+  for (int i = 0; i < 24; i++) {
+    int v = 8 + 10 * i;
+    palette[232 + i] = (v << 16) | (v << 8) | v;
+  }
+}
+
+
+static inline void cell_colors(const Cell *cell, int *fg, int *bg) {
+  *fg = cell->fg;
+  *bg = cell->bg;
+  if (cell->attr & ATTR_REVERSE) {
+    int t = *fg;
+    *fg = *bg;
+    *bg = t;
+  }
+}
+
+// Draws the static layer once per size: the black background with the
+// terminal grid lines. A 1-bit mask of the same lines clips background
+// fills so coloured cells keep their grid lines.
+static void create_layers(int w, int h) {
+  int screen = DefaultScreen(display);
+  if (cur->backBuffer)
+    XFreePixmap(display, cur->backBuffer);
+  if (cur->gridLayer)
+    XFreePixmap(display, cur->gridLayer);
+  if (cur->bgMask)
+    XFreePixmap(display, cur->bgMask);
+
+  cur->backBuffer =
+      XCreatePixmap(display, window, w, h, DefaultDepth(display, screen));
+  cur->gridLayer =
+      XCreatePixmap(display, window, w, h, DefaultDepth(display, screen));
+  cur->bgMask = XCreatePixmap(display, window, w, h, 1);
+
+  GC maskGC = XCreateGC(display, cur->bgMask, 0, NULL);
+  XSetForeground(display, maskGC, 1);
+  XFillRectangle(display, cur->bgMask, maskGC, 0, 0, w, h);
+  XSetForeground(display, maskGC, 0);
+
+  XSetForeground(display, gc, BlackPixel(display, screen));
+  XFillRectangle(display, cur->gridLayer, gc, 0, 0, w, h);
+
+  // Draw grid (if debugging)
+  if (DEBUG_GRID) {
+    XSetForeground(display, gc, GRID_COLOR);
+    for (int i = 0; i <= cur->rows; i++) {
+      int y = PADDING + i * charH;
+      XDrawLine(display, cur->gridLayer, gc, PADDING, y,
+                PADDING + cur->cols * charW, y);
+      XDrawLine(display, cur->bgMask, maskGC, PADDING, y,
+                PADDING + cur->cols * charW, y);
+    }
+  }
 
-static inline int winW() {
-  XWindowAttributes wa;
-  XGetWindowAttributes(display, window, &wa);
-  return wa.width;
+  // Draw terminal grid lines
+  XSetForeground(display, gc, BlackPixel(display, screen));
+  for (int j = 0; j <= cur->cols; j++) {
+    int x = PADDING + j * charW;
+    XDrawLine(display, cur->gridLayer, gc, x, PADDING, x,
+              PADDING + cur->rows * charH);
+    XDrawLine(display, cur->bgMask, maskGC, x, PADDING, x,
+              PADDING + cur->rows * charH);
+  }
+  XFreeGC(display, maskGC);
+
+  if (!cur->bgGC)
+    cur->bgGC = XCreateGC(display, window, 0, NULL);
+  XSetClipMask(display, cur->bgGC, cur->bgMask);
+  cur->full_repaint = 1;
 }
 
-static inline int winH() {
-  XWindowAttributes wa;
-  XGetWindowAttributes(display, window, &wa);
-  return wa.height;
+// The image backend's framebuffer for the current window. Without one the
+// window is drawn with core requests.
+static void drop_surface() {
+  raster_surface_free();
+  cur->surface = NULL;
+  cur->use_raster = 0;
 }
 
 static void ensure_resize(int newW, int newH) {
@@ -50,17 +223,47 @@ static void ensure_resize(int newW, int newH) {
   newCols = (newCols < 1) ? 1 : newCols;
   newRows = (newRows < 1) ? 1 : newRows;
 
-  if (newCols != cols || newRows != rows) {
-    cols = newCols;
-    rows = newRows;
-    resize_terminal(rows, cols);
+  if (newCols != cur->cols || newRows != cur->rows) {
+    cur->cols = newCols;
+    cur->rows = newRows;
+    tabs_resize(cur->rows, cur->cols);
 
-    if (backBuffer)
-      XFreePixmap(display, backBuffer);
+    if (!cur->use_raster)
+      create_layers(newW, newH);
+  }
+  if (cur->use_raster && (newW != cur->raster_w || newH != cur->raster_h)) {
+    if (raster_resize(newW, newH) < 0) {
+      fprintf(stderr, "Image backend failed, using core rendering\n");
+      drop_surface();
+      create_layers(newW, newH);
+    }
+    cur->raster_w = newW;
+    cur->raster_h = newH;
+    cur->full_repaint = 1;
+  }
+}
 
-    backBuffer = XCreatePixmap(display, window, newW, newH,
-                               DefaultDepth(display, DefaultScreen(display)));
+static void init_backend(int w, int h) {
+  if (raster_ok < 0) {
+    const char *env = getenv("MT_RENDER");
+    raster_ok = !(env && strcmp(env, "core") == 0) &&
+                raster_init(display, font, charW, charH, palette,
+                            BlackPixel(display, DefaultScreen(display))) == 0;
+    if (!raster_ok)
+      raster_cleanup();
+    latency_mark("glyph cache");
   }
+  if (raster_ok) {
+    cur->surface = raster_surface_create(window);
+    cur->use_raster = cur->surface != NULL;
+    if (cur->use_raster && raster_resize(w, h) == 0) {
+      cur->raster_w = w;
+      cur->raster_h = h;
+      return;
+    }
+    drop_surface();
+  }
+  create_layers(w, h);
 }
 
 static void handle_signal(int signum) {
@@ -74,6 +277,7 @@ void init_rendering() {
     fprintf(stderr, "Error: Unable to open X display\n");
     exit(1);
   }
+  latency_mark("display opened");
 
   signal(SIGINT, handle_signal);
   signal(SIGTERM, handle_signal);
@@ -86,128 +290,756 @@ void init_rendering() {
     fprintf(stderr, "Error: Unable to load font\n");
     exit(1);
   }
+  latency_mark("font loaded");
+
+  init_palette();
 
   charW = font->max_bounds.width;
   charH = font->ascent + font->descent;
 
-  cols = TERM_COLS;
-  rows = TERM_ROWS;
+  const char *settle = getenv("MT_RESIZE_SETTLE_MS");
+  if (settle)
+    resize_settle_ms = atol(settle);
+  if (resize_settle_ms > 0) {
+    resize_timer_fd =
+        timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (resize_timer_fd < 0)
+      perror("timerfd_create");
+  }
 
-  int w = cols * charW + 2 * PADDING;
-  int h = rows * charH + 2 * PADDING;
+  wmDelete = XInternAtom(display, "WM_DELETE_WINDOW", False);
+  // Windows come and go, so the GC and the glyph caches are made for the
+  // root window, which has the same depth.
+  gc = XCreateGC(display, RootWindow(display, screen), 0, NULL);
+  XSetFont(display, gc, font->fid);
+  XSetForeground(display, gc, WhitePixel(display, screen));
+
+  paste_init(display);
+}
+
+static int want_frame(Win *w) {
+  if (w->frame_wanted)
+    frames_merged++;
+  return w->frame_wanted = 1;
+}
 
-  window = XCreateSimpleWindow(display, RootWindow(display, screen), 0, 0, w, h,
-                               BORDER_WIDTH, BlackPixel(display, screen),
-                               BlackPixel(display, screen));
-  if (!window) {
+static int win_visible(const Win *w) { return w->mapped && !w->obscured; }
+
+// Fits the layers and the terminal to the size the window last reported.
+static void apply_size(Win *w) {
+  w->win_w = w->pending_w;
+  w->win_h = w->pending_h;
+  ensure_resize(w->win_w, w->win_h);
+}
+
+// Notes a Map, Unmap or VisibilityNotify for the current window. Sizes
+// that came while it was hidden are applied once it shows. Returns 1 if
+// it wants a frame.
+static int set_visibility(Win *w, int mapped, int obscured) {
+  int was = win_visible(w);
+  w->mapped = mapped;
+  w->obscured = obscured;
+  if (was || !win_visible(w))
+    return 0;
+  if (w->pending_w != w->win_w || w->pending_h != w->win_h)
+    apply_size(w);
+  w->full_repaint = 1;
+  return w->frame_wanted = 1;
+}
+
+static Win *find_win(Window xwin) {
+  for (int i = 0; i < nwins; i++)
+    if (wins[i]->xwin == xwin)
+      return wins[i];
+  return NULL;
+}
+
+// Makes w the window being handled and locks its visible tab. Keys typed
+// into the window being left are sent now rather than when its shell next
+// prints something.
+static void select_win(Win *w) {
+  terminal_lock();
+  if (w == cur)
+    return;
+  terminal_flush_input();
+  cur = w;
+  window = w ? w->xwin : None;
+  if (!w)
+    return;
+  tabs_use(w->tabs);
+  snapshot_select(w->snapshot);
+  raster_surface_select(w->surface);
+  terminal_select(tabs_visible());
+  terminal_lock();
+}
+
+unsigned render_open_window() {
+  if (nwins == wins_cap) {
+    int cap = wins_cap ? 2 * wins_cap : 4;
+    Win **p = realloc(wins, cap * sizeof(*p));
+    if (!p) {
+      perror("alloc windows");
+      return 0;
+    }
+    wins = p;
+    wins_cap = cap;
+  }
+  Win *w = calloc(1, sizeof(*w));
+  if (!w) {
+    perror("alloc window");
+    return 0;
+  }
+  int screen = DefaultScreen(display);
+  w->id = next_win_id++;
+  w->full_repaint = 1;
+  w->drawn_cursor_row = -1;
+  w->frame_wanted = 1;
+  w->cols = TERM_COLS;
+  w->rows = TERM_ROWS;
+  w->win_w = w->pending_w = w->cols * charW + 2 * PADDING;
+  w->win_h = w->pending_h = w->rows * charH + 2 * PADDING;
+  w->xwin = XCreateSimpleWindow(display, RootWindow(display, screen), 0, 0,
+                                w->win_w, w->win_h, BORDER_WIDTH,
+                                BlackPixel(display, screen),
+                                BlackPixel(display, screen));
+  if (!w->xwin) {
     fprintf(stderr, "Error: Failed to create window\n");
     exit(1);
   }
+  wins[nwins++] = w;
 
-  XStoreName(display, window, "Minimal Terminal");
-  wmDelete = XInternAtom(display, "WM_DELETE_WINDOW", False);
+  // Input typed into the window we came from is sent first.
+  select_win(NULL);
+  raster_surface_select(NULL);
+  cur = w;
+  window = w->xwin;
+  XStoreName(display, window, DEFAULT_TITLE);
   XSetWMProtocols(display, window, &wmDelete, 1);
-
-  gc = XCreateGC(display, window, 0, NULL);
-  XSetFont(display, gc, font->fid);
-  XSetForeground(display, gc, WhitePixel(display, screen));
-
   XSelectInput(display, window,
-               ExposureMask | KeyPressMask | StructureNotifyMask);
+               ExposureMask | KeyPressMask | ButtonPressMask |
+                   StructureNotifyMask | VisibilityChangeMask |
+                   PropertyChangeMask);
   XMapWindow(display, window);
   XFlush(display);
+  latency_mark("window mapped");
 
-  backBuffer =
-      XCreatePixmap(display, window, w, h, DefaultDepth(display, screen));
+  init_backend(w->win_w, w->win_h);
+  latency_mark("backing store");
+  w->snapshot = snapshot_init();
+  w->tabs = tabs_init(w->rows, w->cols);
+  latency_mark("session created");
+  return w->id;
+}
 
-  init_terminal(rows, cols);
-  terminal_start_shell();
-  init_input();
+// Closes the window and every tab in it.
+static void close_win(Win *w) {
+  select_win(w);
+  tabs_free();
+  snapshot_free();
+  if (w->surface)
+    raster_surface_free();
+  if (w->backBuffer)
+    XFreePixmap(display, w->backBuffer);
+  if (w->gridLayer)
+    XFreePixmap(display, w->gridLayer);
+  if (w->bgMask)
+    XFreePixmap(display, w->bgMask);
+  if (w->bgGC)
+    XFreeGC(display, w->bgGC);
+  if (w->xwin)
+    XDestroyWindow(display, w->xwin);
+  for (int i = 0; i < nwins; i++) {
+    if (wins[i] == w) {
+      wins[i] = wins[--nwins];
+      break;
+    }
+  }
+  free(w);
+  cur = NULL;
+  window = None;
+  // Some session stays current for the main loop.
+  if (nwins > 0)
+    select_win(wins[0]);
 }
 
-void render_screen() {
-  int w = winW(), h = winH();
-  ensure_resize(w, h);
+int render_window_count() { return nwins; }
 
-  XSetForeground(display, gc, BlackPixel(display, DefaultScreen(display)));
-  XFillRectangle(display, backBuffer, gc, 0, 0, w, h);
+long render_window_frames(unsigned id) {
+  for (int i = 0; i < nwins; i++)
+    if (wins[i]->id == id)
+      return wins[i]->frames;
+  return -1;
+}
 
-  // Draw grid (if debugging)
-  if (DEBUG_GRID) {
-    XSetForeground(display, gc, GRID_COLOR);
-    for (int i = 0; i <= rows; i++) {
-      int y = PADDING + i * charH;
-      XDrawLine(display, backBuffer, gc, PADDING, y, PADDING + cols * charW, y);
+// Per-frame batches. Damaged spans are collected first and then drawn in
+// phases across the whole frame: static layer, backgrounds grouped by
+// colour, text runs grouped by colour, and finally the copies to the
+// window, so the request count depends on the number of colour runs rather
+// than the number of cells.
+typedef struct {
+  int r, c0, c1;
+} Span;
+
+typedef struct {
+  int color;
+  int x, y;
+  int start, len; // into text_pool
+} TextRun;
+
+typedef struct {
+  int color;
+  XRectangle rect;
+} BgRun;
+
+static Span *spans;
+static int *row_span; // index into spans for each row, or -1
+static int nspans;
+static TextRun *text_runs;
+static int ntext_runs;
+static BgRun *bg_runs;
+static int nbg_runs;
+static char *text_pool;
+static int text_pool_len;
+static XRectangle *rect_scratch;
+static int batch_rows;
+static size_t batch_cells;
+
+// The batches are shared by all windows, so they only grow.
+static void ensure_batches() {
+  size_t cells = (size_t)cur->rows * cur->cols;
+  if (cur->rows <= batch_rows && cells <= batch_cells)
+    return;
+  int nrows = cur->rows > batch_rows ? cur->rows : batch_rows;
+  if (cells < batch_cells)
+    cells = batch_cells;
+  free(spans);
+  free(row_span);
+  free(text_runs);
+  free(bg_runs);
+  free(text_pool);
+  free(rect_scratch);
+  spans = malloc(nrows * sizeof(Span));
+  row_span = malloc(nrows * sizeof(int));
+  text_runs = malloc(cells * sizeof(TextRun));
+  bg_runs = malloc(cells * sizeof(BgRun));
+  text_pool = malloc(cells);
+  rect_scratch = malloc(cells * sizeof(XRectangle));
+  if (!spans || !row_span || !text_runs || !bg_runs || !text_pool ||
+      !rect_scratch) {
+    fprintf(stderr, "Error: Unable to allocate render batches\n");
+    exit(1);
+  }
+  for (int r = 0; r < nrows; r++)
+    row_span[r] = -1;
+  batch_rows = nrows;
+  batch_cells = cells;
+}
+
+static void add_span(int r, int c0, int c1) {
+  if (c1 > snap->cols)
+    c1 = snap->cols;
+  if (r < 0 || r >= cur->rows || r >= snap->rows || c0 >= c1)
+    return;
+  int i = row_span[r];
+  if (i >= 0) {
+    if (c0 < spans[i].c0)
+      spans[i].c0 = c0;
+    if (c1 > spans[i].c1)
+      spans[i].c1 = c1;
+    return;
+  }
+  row_span[r] = nspans;
+  spans[nspans++] = (Span){r, c0, c1};
+}
+
+// Splits a span into background runs and text runs. Spaces carry no ink,
+// so they join whatever text run surrounds them.
+static void collect_runs(const Span *s) {
+  const Cell *line = snapshot_row(snap, s->r);
+  int y = PADDING + s->r * charH;
+
+  int bg_start = s->c0, bg_color = -1;
+  int text_start = -1, text_end = -1, text_color = -1;
+  for (int c = s->c0; c <= s->c1; c++) {
+    int fg = -1, bg = -1;
+    uint32_t ch = ' ';
+    if (c < s->c1) {
+      cell_colors(&line[c], &fg, &bg);
+      ch = line[c].ch;
+    }
+    if (bg != bg_color) {
+      if (bg_color >= 0 && bg_color != CELL_DEFAULT_BG)
+        bg_runs[nbg_runs++] = (BgRun){
+            bg_color, {PADDING + bg_start * charW, y,
+                       (unsigned short)((c - bg_start) * charW),
+                       (unsigned short)charH}};
+      bg_start = c;
+      bg_color = bg;
+    }
+    int ink = ch != ' ';
+    if (text_start >= 0 && (c == s->c1 || (ink && fg != text_color))) {
+      TextRun *run = &text_runs[ntext_runs++];
+      *run = (TextRun){text_color, PADDING + text_start * charW,
+                       y + font->ascent, text_pool_len,
+                       text_end - text_start};
+      for (int k = text_start; k < text_end; k++) {
+        uint32_t t = line[k].ch;
+        // The core font only covers Latin-1.
+        text_pool[text_pool_len++] = t < 256 ? (char)t : '?';
+      }
+      text_start = -1;
+    }
+    if (ink) {
+      if (text_start < 0) {
+        text_start = c;
+        text_color = fg;
+      }
+      text_end = c + 1;
     }
   }
+}
 
-  // Draw terminal grid lines
-  for (int j = 0; j <= cols; j++) {
-    int x = PADDING + j * charW;
-    XDrawLine(display, backBuffer, gc, x, PADDING, x, PADDING + rows * charH);
-  }
-
-  // Draw characters from terminal buffer
-  XSetForeground(display, gc, WhitePixel(display, DefaultScreen(display)));
-  const char **buf = get_terminal_buffer();
-  for (int r = 0; r < rows; r++) {
-    for (int c = 0; c < cols; c++) {
-      char ch = buf[r][c];
-      if (ch != ' ') {
-        int x = PADDING + c * charW;
-        int y = PADDING + r * charH + font->ascent;
-        char txt[2] = {ch, '\0'};
-        XDrawString(display, backBuffer, gc, x, y, txt, 1);
+static void flush_bg_runs() {
+  for (int i = 0; i < nbg_runs; i++) {
+    int color = bg_runs[i].color;
+    if (color < 0)
+      continue;
+    int n = 0;
+    for (int j = i; j < nbg_runs; j++) {
+      if (bg_runs[j].color == color) {
+        rect_scratch[n++] = bg_runs[j].rect;
+        bg_runs[j].color = -1;
       }
     }
+    XSetForeground(display, cur->bgGC, palette[color]);
+    XFillRectangles(display, cur->backBuffer, cur->bgGC, rect_scratch, n);
   }
+}
+
+static void flush_text_runs() {
+  for (int i = 0; i < ntext_runs; i++) {
+    int color = text_runs[i].color;
+    if (color < 0)
+      continue;
+    XSetForeground(display, gc, palette[color]);
+    for (int j = i; j < ntext_runs; j++) {
+      TextRun *run = &text_runs[j];
+      if (run->color == color) {
+        XDrawString(display, cur->backBuffer, gc, run->x, run->y,
+                    text_pool + run->start, run->len);
+        run->color = -1;
+      }
+    }
+  }
+}
+
+// Turns spans into window rectangles, merging vertically adjacent rows
+// that cover the same columns into one rectangle.
+static int merge_spans(XRectangle *out) {
+  int n = 0;
+  for (int i = 0; i < nspans;) {
+    int j = i + 1;
+    while (j < nspans && spans[j].r == spans[j - 1].r + 1 &&
+           spans[j].c0 == spans[i].c0 && spans[j].c1 == spans[i].c1)
+      j++;
+    out[n++] = (XRectangle){PADDING + spans[i].c0 * charW,
+                            PADDING + spans[i].r * charH,
+                            (unsigned short)((spans[i].c1 - spans[i].c0) *
+                                             charW),
+                            (unsigned short)((j - i) * charH)};
+    i = j;
+  }
+  return n;
+}
+
+static void copy_spans() {
+  int n = merge_spans(rect_scratch);
+  for (int i = 0; i < n; i++)
+    XCopyArea(display, cur->backBuffer, window, gc, rect_scratch[i].x,
+              rect_scratch[i].y, rect_scratch[i].width, rect_scratch[i].height,
+              rect_scratch[i].x, rect_scratch[i].y);
+}
+
+// Cells under the overlay are drawn as usual and then covered by it, so
+// hiding it only needs a repaint.
+static int stats_col0() {
+  return cur->cols > STATS_OVERLAY_COLS ? cur->cols - STATS_OVERLAY_COLS : 0;
+}
+
+static void add_stats_spans() {
+  for (int r = 0; r < nstats_lines; r++)
+    add_span(r, stats_col0(), cur->cols);
+}
+
+static void draw_stats() {
+  int c0 = stats_col0();
+  int len = cur->cols - c0;
+  if (len > STATS_OVERLAY_COLS)
+    len = STATS_OVERLAY_COLS;
+  if (!cur->use_raster) {
+    XSetForeground(display, gc, palette[STATS_FG]);
+    XSetBackground(display, gc, palette[STATS_BG]);
+  }
+  for (int r = 0; r < nstats_lines && r < cur->rows; r++) {
+    int x = PADDING + c0 * charW, y = PADDING + r * charH;
+    if (!cur->use_raster) {
+      XDrawImageString(display, cur->backBuffer, gc, x, y + font->ascent,
+                       stats_lines[r], len);
+      continue;
+    }
+    for (int c = 0; c < len; c++)
+      raster_cell(x + c * charW, y, (unsigned char)stats_lines[r][c],
+                  STATS_FG, STATS_BG, 0);
+  }
+}
+
+// Image backend: every span is composited from cached cell tiles into the
+// framebuffer, which is then presented in one go.
+static void raster_spans(int show_cursor, int cr, int cc) {
+  raster_wait_idle();
+  if (cur->full_repaint)
+    raster_fill(0, 0, cur->raster_w, cur->raster_h,
+                BlackPixel(display, DefaultScreen(display)));
+  for (int i = 0; i < nspans; i++) {
+    const Cell *line = snapshot_row(snap, spans[i].r);
+    int y = PADDING + spans[i].r * charH;
+    for (int c = spans[i].c0; c < spans[i].c1; c++) {
+      int fg, bg;
+      cell_colors(&line[c], &fg, &bg);
+      raster_cell(PADDING + c * charW, y, line[c].ch, fg, bg, line[c].attr);
+    }
+  }
+
+  cur->drawn_cursor_row = -1;
+  if (show_cursor) {
+    raster_fill(PADDING + cc * charW, PADDING + cr * charH + charH - 2, charW,
+                2, colors[ANSI_COLOR_WHITE]);
+    cur->drawn_cursor_row = cr;
+    cur->drawn_cursor_col = cc;
+  }
+  draw_stats();
+
+  if (cur->full_repaint) {
+    XRectangle all = {0, 0, (unsigned short)cur->raster_w,
+                      (unsigned short)cur->raster_h};
+    raster_present(gc, &all, 1);
+    cur->full_repaint = 0;
+  } else {
+    raster_present(gc, rect_scratch, merge_spans(rect_scratch));
+  }
+}
+
+void render_invalidate() { cur->full_repaint = 1; }
+
+// Core backend: server-side drawing into the back buffer, then copies.
+static void core_spans(int show_cursor, int cr, int cc) {
+  int w = cur->win_w, h = cur->win_h;
+
+  // Static layer: black background and grid lines, restored per span.
+  if (cur->full_repaint) {
+    XCopyArea(display, cur->gridLayer, cur->backBuffer, gc, 0, 0, w, h, 0, 0);
+  } else {
+    for (int i = 0; i < nspans; i++) {
+      int x = PADDING + spans[i].c0 * charW, y = PADDING + spans[i].r * charH;
+      XCopyArea(display, cur->gridLayer, cur->backBuffer, gc, x, y,
+                (spans[i].c1 - spans[i].c0) * charW, charH, x, y);
+    }
+  }
+  for (int i = 0; i < nspans; i++)
+    collect_runs(&spans[i]);
+  flush_bg_runs();
+  flush_text_runs();
 
   // Draw cursor
-  int cr = get_cursor_row(), cc = get_cursor_col();
-  XSetForeground(display, gc, colors[ANSI_COLOR_WHITE]);
-  XFillRectangle(display, backBuffer, gc, PADDING + cc * charW,
-                 PADDING + cr * charH + charH - 2, charW, 2);
+  cur->drawn_cursor_row = -1;
+  if (show_cursor) {
+    XSetForeground(display, gc, colors[ANSI_COLOR_WHITE]);
+    XFillRectangle(display, cur->backBuffer, gc, PADDING + cc * charW,
+                   PADDING + cr * charH + charH - 2, charW, 2);
+    cur->drawn_cursor_row = cr;
+    cur->drawn_cursor_col = cc;
+  }
+  draw_stats();
 
   // Copy back buffer to window
-  XCopyArea(display, backBuffer, window, gc, 0, 0, w, h, 0, 0);
+  if (cur->full_repaint) {
+    XCopyArea(display, cur->backBuffer, window, gc, 0, 0, w, h, 0, 0);
+    cur->full_repaint = 0;
+  } else {
+    copy_spans();
+  }
+}
+
+// Runs with no session locked while the workers parse, so it must not
+// read the terminal: cur, its snapshot and the overlay text taken
+// beforehand are the only state it may touch.
+void render_screen() {
+  uint64_t start = latency_now();
+  unsigned long first_request = NextRequest(display);
+  ensure_batches();
+
+  snap = snapshot_current();
+  int cr = snap->cursor_row, cc = snap->cursor_col;
+  if (cc >= cur->cols)
+    cc = cur->cols - 1;
+  int show_cursor = snap->cursor_visible && cr < cur->rows && cc < snap->cols;
+
+  nspans = nbg_runs = ntext_runs = text_pool_len = 0;
+  if (cur->full_repaint) {
+    for (int r = 0; r < cur->rows; r++)
+      add_span(r, 0, cur->cols);
+  } else {
+    int c0, c1;
+    for (int r = 0; (r = snapshot_next_damaged_row(snap, r, &c0, &c1)) >= 0;
+         r++)
+      add_span(r, c0, c1);
+    // The cursor cell is redrawn where it was last frame and where it is now.
+    if (cur->drawn_cursor_row >= 0 && cur->drawn_cursor_col < cur->cols)
+      add_span(cur->drawn_cursor_row, cur->drawn_cursor_col,
+               cur->drawn_cursor_col + 1);
+    if (show_cursor)
+      add_span(cr, cc, cc + 1);
+    add_stats_spans();
+  }
+
+  if (cur->use_raster)
+    raster_spans(show_cursor, cr, cc);
+  else
+    core_spans(show_cursor, cr, cc);
+
+  for (int i = 0; i < nspans; i++)
+    row_span[spans[i].r] = -1;
   XFlush(display);
+  int slot = frames_drawn++ % RENDER_SAMPLES;
+  uint64_t ns = latency_now() - start;
+  render_ns[slot] = ns < UINT32_MAX ? ns : UINT32_MAX;
+  render_requests[slot] = NextRequest(display) - first_request;
+  if (nrender_samples < RENDER_SAMPLES)
+    nrender_samples++;
+  if (cur->exposed && cur->frames++ == 0)
+    latency_mark("first frame after Expose");
+  latency_frame_presented();
+}
+
+void render_frames() {
+  for (int i = 0; i < nwins; i++) {
+    Win *w = wins[i];
+    if (!w->frame_wanted || !win_visible(w))
+      continue;
+    select_win(w);
+    snapshot_publish();
+    // Sampling the counters reads the sessions, and can wait for a parser,
+    // so it is done here and not timed.
+    nstats_lines =
+        show_stats ? stats_overlay(stats_lines, STATS_MAX_LINES) : 0;
+    // The frame is drawn from the snapshot alone, so the workers can parse
+    // the tab while it is drawn.
+    terminal_unlock();
+    render_screen();
+    w->frame_wanted = 0;
+  }
+}
+
+int render_poll() {
+  terminal_drain_fd();
+  int wanted = 0;
+  for (int i = nwins - 1; i >= 0; i--) {
+    Win *w = wins[i];
+    select_win(w);
+    int r = tabs_poll();
+    if (r < 0) {
+      close_win(w); // its last shell exited
+    } else if (r > 0) {
+      wanted = want_frame(w);
+    }
+  }
+  return wanted;
+}
+
+static int compare_u32(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+void render_counters(RenderCounters *c) {
+  *c = (RenderCounters){.frames = frames_drawn, .merged = frames_merged};
+  int n = nrender_samples;
+  if (n == 0)
+    return;
+  uint32_t sorted[RENDER_SAMPLES];
+  uint64_t ns = 0, requests = 0;
+  for (int i = 0; i < n; i++) {
+    sorted[i] = render_ns[i];
+    ns += render_ns[i];
+    requests += render_requests[i];
+  }
+  qsort(sorted, n, sizeof(sorted[0]), compare_u32);
+  c->mean_us = ns / 1e3 / n;
+  c->p99_us = sorted[(n * 99 + 99) / 100 - 1] / 1e3;
+  c->requests = (double)requests / n;
+}
+
+void render_toggle_stats() {
+  show_stats = !show_stats;
+  stats_due = 0;
+  // Hiding it uncovers cells no span would redraw.
+  for (int i = 0; i < nwins; i++) {
+    wins[i]->full_repaint = 1;
+    wins[i]->frame_wanted = 1;
+  }
+}
+
+int render_stats_due(int *timeout_ms) {
+  *timeout_ms = -1;
+  if (!show_stats)
+    return 0;
+  uint64_t now = latency_now();
+  int due = now >= stats_due;
+  if (due) {
+    stats_due = now + STATS_REFRESH_MS * 1000000ull;
+    for (int i = 0; i < nwins; i++)
+      wins[i]->frame_wanted = 1;
+  }
+  *timeout_ms = (stats_due - now + 999999) / 1000000;
+  return due;
+}
+
+// With more than one tab, the title says which one is shown.
+void render_set_title(const char *title) {
+  if (!title)
+    title = DEFAULT_TITLE;
+  if (tabs_count() < 2) {
+    XStoreName(display, window, title);
+    return;
+  }
+  char buf[400];
+  snprintf(buf, sizeof(buf), "[%d/%d] %s", tabs_index() + 1, tabs_count(),
+           title);
+  XStoreName(display, window, buf);
 }
 
 void handle_key_event(XKeyEvent *kev) { handle_input(kev); }
 
-void process_events() {
+int process_events() {
+  int redraw = 0;
   while (XPending(display)) {
     XEvent e;
     XNextEvent(display, &e);
-    if (e.type == ClientMessage && (Atom)e.xclient.data.l[0] == wmDelete) {
-      render_cleanup();
-      exit(0);
-    }
-
+    // Events are handled with their window's visible tab current.
+    // Anything else is left over from a window that is gone.
+    Win *w = find_win(e.xany.window);
+    if (!w)
+      continue;
+    select_win(w);
     switch (e.type) {
+    case ClientMessage:
+      if ((Atom)e.xclient.data.l[0] == wmDelete)
+        close_win(w);
+      break;
+    case DestroyNotify:
+      w->xwin = None; // already gone
+      close_win(w);
+      break;
     case KeyPress:
       handle_key_event(&e.xkey);
+      if (tabs_count() == 0)
+        close_win(w); // the last tab was closed
+      else
+        redraw = want_frame(w);
+      break;
+    case ButtonPress:
+      if (e.xbutton.button == Button2) {
+        paste_request(w->xwin, PASTE_PRIMARY, e.xbutton.time);
+      } else if (e.xbutton.button == Button4 ||
+                 e.xbutton.button == Button5) {
+        // The wheel scrolls the history a few lines at a time.
+        terminal_scroll_view(e.xbutton.button == Button4 ? WHEEL_LINES
+                                                         : -WHEEL_LINES);
+        redraw = want_frame(w);
+      }
+      break;
+    case SelectionNotify:
+    case PropertyNotify:
+      paste_handle_event(&e);
+      break;
+    case MapNotify:
+      redraw |= set_visibility(w, 1, w->obscured);
+      break;
+    case UnmapNotify:
+      set_visibility(w, 0, w->obscured);
+      break;
+    case VisibilityNotify:
+      redraw |= set_visibility(
+          w, w->mapped, e.xvisibility.state == VisibilityFullyObscured);
       break;
     case Expose:
-      render_screen();
+      w->full_repaint = 1;
+      w->exposed = 1;
+      redraw = want_frame(w);
       break;
     case ConfigureNotify:
-      ensure_resize(e.xconfigure.width, e.xconfigure.height);
-      render_screen();
+      if (e.xconfigure.width == w->pending_w &&
+          e.xconfigure.height == w->pending_h)
+        break; // moved, or the same size again
+      w->pending_w = e.xconfigure.width;
+      w->pending_h = e.xconfigure.height;
+      if (resize_timer_fd < 0) {
+        redraw |= render_handle_resize_timer();
+      } else {
+        struct itimerspec its = {
+            .it_value = {.tv_sec = resize_settle_ms / 1000,
+                         .tv_nsec = resize_settle_ms % 1000 * 1000000L}};
+        timerfd_settime(resize_timer_fd, 0, &its, NULL);
+      }
+      break;
+    default:
+      if (w->use_raster)
+        raster_handle_event(&e);
       break;
     }
   }
+  return redraw;
+}
+
+int render_get_resize_fd() { return resize_timer_fd; }
+
+int render_handle_resize_timer() {
+  uint64_t expirations;
+  if (resize_timer_fd >= 0 &&
+      read(resize_timer_fd, &expirations, sizeof(expirations)) < 0 &&
+      errno != EAGAIN)
+    perror("read resize timer");
+  int redraw = 0;
+  for (int i = 0; i < nwins; i++) {
+    Win *w = wins[i];
+    if ((w->pending_w == w->win_w && w->pending_h == w->win_h) ||
+        !win_visible(w))
+      continue;
+    select_win(w);
+    apply_size(w);
+    redraw = want_frame(w);
+  }
+  return redraw;
 }
 
 void render_cleanup() {
-  if (backBuffer)
-    XFreePixmap(display, backBuffer);
+  if (resize_timer_fd >= 0)
+    close(resize_timer_fd);
+  resize_timer_fd = -1;
+  while (nwins > 0)
+    close_win(wins[nwins - 1]);
+  free(wins);
+  wins = NULL;
+  wins_cap = 0;
+  raster_cleanup();
   if (gc)
     XFreeGC(display, gc);
   if (font)
     XFreeFont(display, font);
   if (display)
     XCloseDisplay(display);
+  gc = NULL;
+  font = NULL;
+  display = NULL;
   terminal_cleanup();
-  input_cleanup();
 }
@@ -12,13 +12,59 @@
 #define COLOR_CYAN    0x00FFFF
 #define COLOR_WHITE   0xFFFFFF
 
+// One process can show several windows on one display connection. They
+// share the font, the palette, the glyph caches and the GC; each has its
+// own tabs, snapshot and backing store. display and gc are shared;
+// window is the window being handled, whose visible tab is the current
+// terminal session.
 extern Display *display;
 extern Window window;
 extern GC gc;
 
+// Opens the display and loads the font; no window is opened yet.
 void init_rendering();
+// Closes every window and the display, and cleans up the terminal.
 void render_cleanup();
+// Opens a window with one tab and makes it current. Returns its id, or 0.
+unsigned render_open_window();
+int render_window_count();
+// Frames drawn in window id since it was first exposed, or -1 if it is
+// closed.
+long render_window_frames(unsigned id);
+// Draws a frame of every window that wants one. Each tab is locked only
+// while its snapshot is published; no session is locked on return.
+void render_frames();
+// Takes the sessions' parsed output. Windows whose last shell exited are
+// closed. Returns nonzero if a frame is wanted.
+int render_poll();
+// Draws the current window from its last snapshot. Called without the
+// session lock; it reads no terminal state.
 void render_screen();
+void render_invalidate();
+// Frame counters for stats.c. Render time (render_screen, up to the
+// flush) and X requests are over the last 256 frames.
+typedef struct {
+  long frames; // drawn, in all windows
+  long merged; // frame requests folded into one already wanted
+  double mean_us, p99_us;
+  double requests; // per frame
+} RenderCounters;
+void render_counters(RenderCounters *c);
+// Shows or hides the stats overlay in every window.
+void render_toggle_stats();
+// The overlay is redrawn every second while it is shown. Returns nonzero
+// if that is due now, and sets *timeout_ms to how long the main loop may
+// wait for the next time, or -1.
+int render_stats_due(int *timeout_ms);
+// NULL restores the default title.
+void render_set_title(const char *title);
+// Window resizes are applied after the size settles, when this timer
+// fires; render_handle_resize_timer returns nonzero if a frame is wanted.
+int render_get_resize_fd();
+int render_handle_resize_timer();
 void handle_key_event(XKeyEvent *event);
+// Handles all queued X events, closing windows the user closes. Returns
+// nonzero if a frame is wanted.
+int process_events();
 
 #endif // RENDER_H
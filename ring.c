@@ -0,0 +1,76 @@
+#include "ring.h"
+#include <stdlib.h>
+
+int ring_init(ByteRing *ring, size_t size) {
+  if (size == 0 || (size & (size - 1)))
+    return -1;
+  ring->data = malloc(size);
+  if (!ring->data)
+    return -1;
+  ring->size = size;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  atomic_init(&ring->bytes_in, 0);
+  atomic_init(&ring->bytes_out, 0);
+  atomic_init(&ring->full_stalls, 0);
+  return 0;
+}
+
+void ring_free(ByteRing *ring) {
+  free(ring->data);
+  ring->data = NULL;
+  ring->size = 0;
+}
+
+size_t ring_write_span(ByteRing *ring, unsigned char **span) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  size_t free_bytes = ring->size - (head - tail);
+  size_t off = head & (ring->size - 1);
+  size_t contiguous = ring->size - off;
+  *span = ring->data + off;
+  return free_bytes < contiguous ? free_bytes : contiguous;
+}
+
+void ring_commit(ByteRing *ring, size_t n) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  atomic_store_explicit(&ring->head, head + n, memory_order_release);
+  atomic_fetch_add_explicit(&ring->bytes_in, n, memory_order_relaxed);
+}
+
+void ring_note_full(ByteRing *ring) {
+  atomic_fetch_add_explicit(&ring->full_stalls, 1, memory_order_relaxed);
+}
+
+size_t ring_read_span(ByteRing *ring, const unsigned char **span) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  size_t used = head - tail;
+  size_t off = tail & (ring->size - 1);
+  size_t contiguous = ring->size - off;
+  *span = ring->data + off;
+  return used < contiguous ? used : contiguous;
+}
+
+void ring_consume(ByteRing *ring, size_t n) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+  atomic_fetch_add_explicit(&ring->bytes_out, n, memory_order_relaxed);
+}
+
+size_t ring_used(const ByteRing *ring) {
+  return atomic_load_explicit(&ring->head, memory_order_acquire) -
+         atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+uint64_t ring_bytes_in(const ByteRing *ring) {
+  return atomic_load_explicit(&ring->bytes_in, memory_order_relaxed);
+}
+
+uint64_t ring_bytes_out(const ByteRing *ring) {
+  return atomic_load_explicit(&ring->bytes_out, memory_order_relaxed);
+}
+
+uint64_t ring_full_stalls(const ByteRing *ring) {
+  return atomic_load_explicit(&ring->full_stalls, memory_order_relaxed);
+}
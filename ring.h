@@ -0,0 +1,39 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Single-producer/single-consumer byte ring. The producer only advances
+// head, the consumer only advances tail, so neither side takes a lock.
+// Both sides work on contiguous spans to allow large reads and batched
+// parsing without an intermediate copy.
+typedef struct {
+  unsigned char *data;
+  size_t size; // power of two
+  _Alignas(64) _Atomic size_t head;
+  _Alignas(64) _Atomic size_t tail;
+  _Alignas(64) _Atomic uint64_t bytes_in;
+  _Atomic uint64_t bytes_out;
+  _Atomic uint64_t full_stalls; // producer found the ring full
+} ByteRing;
+
+int ring_init(ByteRing *ring, size_t size);
+void ring_free(ByteRing *ring);
+
+// Producer side: returns the contiguous free span, then commits n bytes.
+size_t ring_write_span(ByteRing *ring, unsigned char **span);
+void ring_commit(ByteRing *ring, size_t n);
+void ring_note_full(ByteRing *ring);
+
+// Consumer side: returns the contiguous readable span, then consumes n bytes.
+size_t ring_read_span(ByteRing *ring, const unsigned char **span);
+void ring_consume(ByteRing *ring, size_t n);
+
+size_t ring_used(const ByteRing *ring);
+uint64_t ring_bytes_in(const ByteRing *ring);
+uint64_t ring_bytes_out(const ByteRing *ring);
+uint64_t ring_full_stalls(const ByteRing *ring);
+
+#endif // RING_H
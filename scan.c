@@ -0,0 +1,131 @@
+#include "scan.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+typedef size_t (*ScanFunc)(const unsigned char *s, size_t len);
+typedef void (*ExpandFunc)(uint64_t *dst, const unsigned char *s, size_t n,
+                           uint64_t high);
+
+static size_t scan_scalar(const unsigned char *s, size_t len) {
+  size_t i = 0;
+  while (i < len && s[i] >= 0x20 && s[i] < 0x7f)
+    i++;
+  return i;
+}
+
+static void expand_scalar(uint64_t *dst, const unsigned char *s, size_t n,
+                          uint64_t high) {
+  for (size_t k = 0; k < n; k++)
+    dst[k] = high | s[k];
+}
+
+#ifdef HAVE_X86_SIMD
+// A byte ends the run if it is below 0x20 as a signed value (which also
+// catches 0x80-0xff) or equal to 0x7f.
+__attribute__((target("sse2"))) static size_t
+scan_sse2(const unsigned char *s, size_t len) {
+  const __m128i space = _mm_set1_epi8(0x20);
+  const __m128i del = _mm_set1_epi8(0x7f);
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    __m128i bad = _mm_or_si128(_mm_cmplt_epi8(v, space),
+                               _mm_cmpeq_epi8(v, del));
+    int mask = _mm_movemask_epi8(bad);
+    if (mask)
+      return i + __builtin_ctz(mask);
+  }
+  return i + scan_scalar(s + i, len - i);
+}
+
+// Zero-extends 16 bytes to 32 bits and interleaves them with the high half.
+__attribute__((target("sse2"))) static void
+expand_sse2(uint64_t *dst, const unsigned char *s, size_t n, uint64_t high) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i hi = _mm_set1_epi32((int)(high >> 32));
+  size_t k = 0;
+  for (; k + 16 <= n; k += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + k));
+    __m128i w[2] = {_mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero)};
+    __m128i *out = (__m128i *)(dst + k);
+    for (int h = 0; h < 2; h++) {
+      __m128i d0 = _mm_unpacklo_epi16(w[h], zero);
+      __m128i d1 = _mm_unpackhi_epi16(w[h], zero);
+      _mm_storeu_si128(out++, _mm_unpacklo_epi32(d0, hi));
+      _mm_storeu_si128(out++, _mm_unpackhi_epi32(d0, hi));
+      _mm_storeu_si128(out++, _mm_unpacklo_epi32(d1, hi));
+      _mm_storeu_si128(out++, _mm_unpackhi_epi32(d1, hi));
+    }
+  }
+  expand_scalar(dst + k, s + k, n - k, high);
+}
+
+__attribute__((target("avx2"))) static size_t
+scan_avx2(const unsigned char *s, size_t len) {
+  const __m256i space = _mm256_set1_epi8(0x1f);
+  const __m256i del = _mm256_set1_epi8(0x7f);
+  size_t i = 0;
+  unsigned mask = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i bad = _mm256_or_si256(_mm256_cmpgt_epi8(space, v),
+                                  _mm256_cmpeq_epi8(v, del));
+    mask = (unsigned)_mm256_movemask_epi8(bad);
+    if (mask)
+      break;
+  }
+  // GCC clears the upper halves at the return but not before the call to
+  // scan_sse2, whose legacy SSE code would then run slowly, so both exits
+  // clear them here.
+  _mm256_zeroupper();
+  if (mask)
+    return i + __builtin_ctz(mask);
+  return i + scan_sse2(s + i, len - i);
+}
+#endif
+
+static ScanFunc scan_impl = scan_scalar;
+static ExpandFunc expand_impl = expand_scalar;
+static const char *scan_name = "scalar";
+
+void scan_init(void) {
+  const char *force = getenv("MT_SIMD");
+  scan_impl = scan_scalar;
+  expand_impl = expand_scalar;
+  scan_name = "scalar";
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  int sse2 = __builtin_cpu_supports("sse2");
+  int avx2 = __builtin_cpu_supports("avx2");
+  if (force && strcmp(force, "scalar") == 0)
+    return;
+  // The expansion is store-bound, so SSE2 is used for it on both paths.
+  if (sse2)
+    expand_impl = expand_sse2;
+  if (avx2 && !(force && strcmp(force, "sse2") == 0)) {
+    scan_impl = scan_avx2;
+    scan_name = "avx2";
+  } else if (sse2) {
+    scan_impl = scan_sse2;
+    scan_name = "sse2";
+  }
+#else
+  (void)force;
+#endif
+}
+
+const char *scan_impl_name(void) { return scan_name; }
+
+size_t scan_printable(const unsigned char *s, size_t len) {
+  return scan_impl(s, len);
+}
+
+void scan_expand(uint64_t *dst, const unsigned char *s, size_t n,
+                 uint64_t high) {
+  expand_impl(dst, s, n, high);
+}
@@ -0,0 +1,22 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Vectorised scanning of PTY output. The implementation (scalar, SSE2 or
+// AVX2) is picked at runtime from the CPU features; MT_SIMD=scalar|sse2|avx2
+// overrides the choice, e.g. for comparing against the scalar path.
+void scan_init(void);
+const char *scan_impl_name(void);
+
+// Returns the length of the leading run of printable ASCII (0x20-0x7e),
+// i.e. the offset of the first control byte, ESC, DEL or non-ASCII byte.
+size_t scan_printable(const unsigned char *s, size_t len);
+
+// Widens n bytes into 64-bit slots: dst[k] = high | s[k]. Used to turn a
+// printable run into cells that share one set of attributes.
+void scan_expand(uint64_t *dst, const unsigned char *s, size_t n,
+                 uint64_t high);
+
+#endif // SCAN_H
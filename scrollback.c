@@ -0,0 +1,500 @@
+#include "scrollback.h"
+#include "lz.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHUNK_SIZE (64 * 1024)
+#define DEFAULT_SCROLLBACK_LINES 10000
+#define DEFAULT_SCROLLBACK_BYTES (8 << 20)
+#define DEFAULT_SPILL_BYTES (2 << 20)
+// A chunk expanded for viewing stays expanded this long after its last use.
+#define COLD_MS 2000
+// A chunk takes at most this share of the line cap, so evicting one never
+// drops more than a quarter of the history.
+#define CHUNK_LINE_SHARE 4
+
+// Record layout: uint16 ncells, uint16 nruns, nruns * Run, then UTF-8.
+#define RECORD_HEADER 4
+#define RUN_SIZE 6
+
+// Only the newest chunk is written to. Once closed, a chunk is compressed
+// into packed and its buffer dropped; viewing it expands a copy again. With
+// more packed bytes than the spill threshold, the oldest packed copies move
+// to the spill file at slot * CHUNK_SIZE. Closed chunks never change, so a
+// packed or spilled copy stays valid and re-cooling just frees data.
+typedef struct {
+  unsigned char *data;   // expanded records, NULL while cold
+  unsigned char *packed; // compressed copy in memory
+  uint32_t used;
+  uint32_t nlines;
+  uint32_t packed_len; // size of the compressed copy, in memory or on disk
+  uint8_t spilled;
+  uint8_t incompressible; // kept expanded: compressing did not pay off
+  uint64_t last_used;     // ms, 0 if never viewed
+  uint64_t serial;        // changes each time the slot is reused
+} Chunk;
+
+// Limits shared by every history, read from the environment once.
+static int configured;
+static int max_lines;
+static int max_chunks;
+static int chunk_lines_max;
+static int compress_chunks;
+static size_t spill_bytes;
+
+struct Scrollback {
+  // Chunks form a ring of max_chunks slots, oldest at chunk_head.
+  Chunk *chunks;
+  int chunk_head, nchunks;
+  // Where line seq lives: chunk slot << 16 | offset, at line_index[seq %
+  // max_lines]. Lines first_seq .. next_seq-1 are stored.
+  uint32_t *line_index;
+  uint64_t first_seq, next_seq;
+
+  size_t spill_threshold; // SIZE_MAX once spilling has failed
+  size_t packed_bytes;    // compressed copies held in memory
+  int spill_fd;
+  // A buffer freed by cooling, reused by the next chunk opened.
+  unsigned char *spare;
+  uint64_t chunk_serial;
+  // Cold chunk expanded for scrollback_text without waking it up.
+  unsigned char *peek_buf;
+  uint64_t peek_serial;
+};
+
+// The history the calling thread works on; see scrollback_select.
+static __thread Scrollback *sb;
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline int blank(const Cell *c) {
+  return c->ch == ' ' && c->bg == CELL_DEFAULT_BG && c->attr == 0;
+}
+
+// fg, bg and attr share the second half of a Cell; compare them at once.
+static inline int same_attrs(const Cell *a, const Cell *b) {
+  uint32_t x, y;
+  memcpy(&x, &a->fg, sizeof(x));
+  memcpy(&y, &b->fg, sizeof(y));
+  return x == y;
+}
+
+static unsigned char *put_utf8(unsigned char *p, uint32_t cp) {
+  if (cp < 0x80) {
+    *p++ = cp;
+  } else if (cp < 0x800) {
+    *p++ = 0xc0 | cp >> 6;
+    *p++ = 0x80 | (cp & 0x3f);
+  } else if (cp < 0x10000) {
+    *p++ = 0xe0 | cp >> 12;
+    *p++ = 0x80 | ((cp >> 6) & 0x3f);
+    *p++ = 0x80 | (cp & 0x3f);
+  } else {
+    *p++ = 0xf0 | cp >> 18;
+    *p++ = 0x80 | ((cp >> 12) & 0x3f);
+    *p++ = 0x80 | ((cp >> 6) & 0x3f);
+    *p++ = 0x80 | (cp & 0x3f);
+  }
+  return p;
+}
+
+static const unsigned char *get_utf8(const unsigned char *p, uint32_t *cp) {
+  unsigned char b = *p++;
+  int extra = b < 0x80 ? 0 : b < 0xe0 ? 1 : b < 0xf0 ? 2 : 3;
+  uint32_t v = extra == 0 ? b : b & (0x3f >> extra);
+  while (extra-- > 0)
+    v = v << 6 | (*p++ & 0x3f);
+  *cp = v;
+  return p;
+}
+
+static void configure(void) {
+  configured = 1;
+  const char *env = getenv("MT_SCROLLBACK_LINES");
+  max_lines = env ? atoi(env) : DEFAULT_SCROLLBACK_LINES;
+  env = getenv("MT_SCROLLBACK_BYTES");
+  long bytes = env ? atol(env) : DEFAULT_SCROLLBACK_BYTES;
+  if (max_lines <= 0 || bytes <= 0) {
+    max_lines = 0;
+    return;
+  }
+  max_chunks = bytes / CHUNK_SIZE;
+  if (max_chunks < 2)
+    max_chunks = 2;
+  if (max_chunks > 65536)
+    max_chunks = 65536;
+  chunk_lines_max = max_lines / CHUNK_LINE_SHARE;
+  if (chunk_lines_max < 1)
+    chunk_lines_max = 1;
+  env = getenv("MT_SCROLLBACK_COMPRESS");
+  compress_chunks = !env || atoi(env) != 0;
+  env = getenv("MT_SCROLLBACK_SPILL");
+  long spill = env ? atol(env) : DEFAULT_SPILL_BYTES;
+  spill_bytes = spill < 0 ? SIZE_MAX : (size_t)spill;
+}
+
+Scrollback *scrollback_init(void) {
+  if (!configured)
+    configure();
+  sb = calloc(1, sizeof(Scrollback));
+  if (!sb) {
+    perror("alloc scrollback");
+    exit(EXIT_FAILURE);
+  }
+  sb->spill_fd = -1;
+  sb->spill_threshold = spill_bytes;
+  if (max_lines == 0)
+    return sb;
+  sb->chunks = calloc(max_chunks, sizeof(Chunk));
+  sb->line_index = malloc((size_t)max_lines * sizeof(uint32_t));
+  if (!sb->chunks || !sb->line_index) {
+    perror("alloc scrollback");
+    exit(EXIT_FAILURE);
+  }
+  return sb;
+}
+
+void scrollback_select(Scrollback *s) { sb = s; }
+
+// Forgets the chunk's contents; its buffer, if any, is kept for reuse.
+static void reset_chunk(Chunk *c) {
+  if (c->packed) {
+    sb->packed_bytes -= c->packed_len;
+    free(c->packed);
+  }
+  *c = (Chunk){.data = c->data};
+}
+
+void scrollback_free(void) {
+  if (!sb)
+    return;
+  for (int i = 0; sb->chunks && i < max_chunks; i++) {
+    reset_chunk(&sb->chunks[i]);
+    free(sb->chunks[i].data);
+  }
+  free(sb->chunks);
+  free(sb->line_index);
+  free(sb->spare);
+  free(sb->peek_buf);
+  if (sb->spill_fd >= 0)
+    close(sb->spill_fd);
+  free(sb);
+  sb = NULL;
+}
+
+void scrollback_clear(void) {
+  for (int i = 0; i < sb->nchunks; i++)
+    reset_chunk(&sb->chunks[(sb->chunk_head + i) % max_chunks]);
+  sb->chunk_head = sb->nchunks = 0;
+  sb->first_seq = sb->next_seq;
+}
+
+static void evict_oldest(void) {
+  Chunk *c = &sb->chunks[sb->chunk_head];
+  sb->first_seq += c->nlines;
+  reset_chunk(c);
+  sb->chunk_head = (sb->chunk_head + 1) % max_chunks;
+  sb->nchunks--;
+}
+
+// The spill file is created on first use and unlinked straight away, so
+// it goes away with the process.
+static int open_spill_file(void) {
+  if (sb->spill_fd >= 0)
+    return 0;
+  const char *dir = getenv("TMPDIR");
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/mt-scrollback-XXXXXX",
+           dir && *dir ? dir : "/tmp");
+  sb->spill_fd = mkstemp(path);
+  if (sb->spill_fd < 0) {
+    perror("scrollback spill file");
+    sb->spill_threshold = SIZE_MAX;
+    return -1;
+  }
+  unlink(path);
+  fcntl(sb->spill_fd, F_SETFD, FD_CLOEXEC);
+  return 0;
+}
+
+static void spill(Chunk *c) {
+  if (open_spill_file() < 0)
+    return;
+  off_t at = (off_t)(c - sb->chunks) * CHUNK_SIZE;
+  if (pwrite(sb->spill_fd, c->packed, c->packed_len, at) !=
+      (ssize_t)c->packed_len) {
+    perror("scrollback spill");
+    sb->spill_threshold = SIZE_MAX;
+    return;
+  }
+  sb->packed_bytes -= c->packed_len;
+  free(c->packed);
+  c->packed = NULL;
+  c->spilled = 1;
+}
+
+static void drop_data(Chunk *c) {
+  if (!sb->spare)
+    sb->spare = c->data;
+  else
+    free(c->data);
+  c->data = NULL;
+}
+
+// Compresses closed chunks not viewed since idle_since and, past the
+// threshold, spills the oldest compressed ones.
+static void cool(uint64_t idle_since) {
+  // Per thread: parser workers cool their sessions' histories in parallel.
+  static __thread unsigned char buf[CHUNK_SIZE];
+  for (int i = 0; i + 1 < sb->nchunks; i++) {
+    Chunk *c = &sb->chunks[(sb->chunk_head + i) % max_chunks];
+    if (!c->data || c->incompressible || c->last_used > idle_since)
+      continue;
+    if (!c->packed && !c->spilled) {
+      // Worth it only if it saves at least an eighth.
+      size_t n = lz_compress(c->data, c->used, buf, c->used - c->used / 8);
+      if (n == 0 || !(c->packed = malloc(n))) {
+        c->incompressible = 1;
+        continue;
+      }
+      memcpy(c->packed, buf, n);
+      c->packed_len = n;
+      sb->packed_bytes += n;
+    }
+    drop_data(c);
+  }
+  for (int i = 0;
+       i + 1 < sb->nchunks && sb->packed_bytes > sb->spill_threshold; i++) {
+    Chunk *c = &sb->chunks[(sb->chunk_head + i) % max_chunks];
+    if (c->packed)
+      spill(c);
+  }
+}
+
+// Decompresses a cold chunk into data; returns 0 on success.
+static int expand(const Chunk *c, unsigned char *data) {
+  size_t n = 0;
+  if (c->packed) {
+    n = lz_decompress(c->packed, c->packed_len, data, CHUNK_SIZE);
+  } else if (c->spilled) {
+    off_t at = (off_t)(c - sb->chunks) * CHUNK_SIZE;
+    void *map =
+        mmap(NULL, c->packed_len, PROT_READ, MAP_PRIVATE, sb->spill_fd, at);
+    if (map != MAP_FAILED) {
+      n = lz_decompress(map, c->packed_len, data, CHUNK_SIZE);
+      munmap(map, c->packed_len);
+    } else {
+      perror("mmap scrollback");
+    }
+  }
+  return n == c->used ? 0 : -1;
+}
+
+// The expanded records of a chunk, decompressing it if it is cold.
+static const unsigned char *chunk_data(Chunk *c) {
+  c->last_used = now_ms();
+  if (c->data)
+    return c->data;
+  unsigned char *data = sb->spare ? sb->spare : malloc(CHUNK_SIZE);
+  if (!data)
+    return NULL;
+  sb->spare = NULL;
+  if (expand(c, data) < 0) {
+    sb->spare = data;
+    return NULL;
+  }
+  return c->data = data;
+}
+
+// Like chunk_data, but a cold chunk is expanded into a scratch buffer and
+// stays cold.
+static const unsigned char *chunk_peek(const Chunk *c) {
+  if (c->data)
+    return c->data;
+  if (sb->peek_buf && sb->peek_serial == c->serial)
+    return sb->peek_buf;
+  if (!sb->peek_buf && !(sb->peek_buf = malloc(CHUNK_SIZE)))
+    return NULL;
+  if (expand(c, sb->peek_buf) < 0) {
+    sb->peek_serial = 0;
+    return NULL;
+  }
+  sb->peek_serial = c->serial;
+  return sb->peek_buf;
+}
+
+// Returns a chunk with room for size bytes and one more line.
+static Chunk *chunk_for(size_t size) {
+  if (sb->nchunks > 0) {
+    Chunk *c = &sb->chunks[(sb->chunk_head + sb->nchunks - 1) % max_chunks];
+    if (c->used + size <= CHUNK_SIZE && (int)c->nlines < chunk_lines_max)
+      return c;
+  }
+  if (sb->nchunks == max_chunks)
+    evict_oldest();
+  Chunk *c = &sb->chunks[(sb->chunk_head + sb->nchunks) % max_chunks];
+  if (!c->data) {
+    c->data = sb->spare ? sb->spare : malloc(CHUNK_SIZE);
+    sb->spare = NULL;
+    if (!c->data) {
+      perror("alloc scrollback chunk");
+      return NULL;
+    }
+  }
+  c->serial = ++sb->chunk_serial;
+  sb->nchunks++;
+  // The previous chunk just closed.
+  if (compress_chunks)
+    cool(now_ms() - COLD_MS);
+  return c;
+}
+
+void scrollback_push(const Cell *cells, int cols) {
+  if (max_lines == 0)
+    return;
+  int n = cols;
+  while (n > 0 && blank(&cells[n - 1]))
+    n--;
+
+  // Reserve room for the worst case of four UTF-8 bytes per cell, cutting
+  // the line short if even that cannot fit a chunk.
+  int nruns;
+  size_t bound;
+  for (;;) {
+    nruns = n > 0;
+    for (int i = 1; i < n; i++)
+      nruns += !same_attrs(&cells[i], &cells[i - 1]);
+    bound = RECORD_HEADER + (size_t)nruns * RUN_SIZE + (size_t)n * 4;
+    if (bound <= CHUNK_SIZE)
+      break;
+    n /= 2;
+  }
+
+  if (sb->next_seq - sb->first_seq == (uint64_t)max_lines)
+    evict_oldest();
+  Chunk *c = chunk_for(bound);
+  if (!c)
+    return;
+
+  unsigned char *start = c->data + c->used;
+  uint16_t hdr[2] = {(uint16_t)n, (uint16_t)nruns};
+  memcpy(start, hdr, RECORD_HEADER);
+  unsigned char *run = start + RECORD_HEADER;
+  unsigned char *text = run + (size_t)nruns * RUN_SIZE;
+  for (int i = 0; i < n;) {
+    int j = i;
+    do {
+      uint32_t ch = cells[j].ch;
+      if (ch < 0x80)
+        *text++ = ch;
+      else
+        text = put_utf8(text, ch);
+      j++;
+    } while (j < n && same_attrs(&cells[j], &cells[i]));
+    uint16_t len = j - i, attr = cells[i].attr;
+    memcpy(run, &len, 2);
+    run[2] = cells[i].fg;
+    run[3] = cells[i].bg;
+    memcpy(run + 4, &attr, 2);
+    run += RUN_SIZE;
+    i = j;
+  }
+
+  sb->line_index[sb->next_seq % max_lines] =
+      (uint32_t)(c - sb->chunks) << 16 | (uint32_t)c->used;
+  sb->next_seq++;
+  c->nlines++;
+  c->used += text - start;
+}
+
+int scrollback_lines(void) { return (int)(sb->next_seq - sb->first_seq); }
+
+uint64_t scrollback_first_seq(void) { return sb->first_seq; }
+
+uint64_t scrollback_end_seq(void) { return sb->next_seq; }
+
+const char *scrollback_text(uint64_t seq, size_t *len) {
+  if (seq < sb->first_seq || seq >= sb->next_seq)
+    return NULL;
+  uint32_t where = sb->line_index[seq % max_lines];
+  const Chunk *c = &sb->chunks[where >> 16];
+  const unsigned char *p = chunk_peek(c);
+  if (!p)
+    return NULL;
+  // The record ends where the next one in the same chunk starts.
+  uint32_t end = c->used;
+  if (seq + 1 < sb->next_seq) {
+    uint32_t next = sb->line_index[(seq + 1) % max_lines];
+    if (next >> 16 == where >> 16)
+      end = next & 0xffff;
+  }
+  p += where & 0xffff;
+  uint16_t hdr[2];
+  memcpy(hdr, p, RECORD_HEADER);
+  size_t start = RECORD_HEADER + (size_t)hdr[1] * RUN_SIZE;
+  *len = end - (where & 0xffff) - start;
+  return (const char *)p + start;
+}
+
+int scrollback_capacity(void) { return max_lines; }
+
+void scrollback_get(int n, Cell *out, int cols) {
+  const Cell blank_cell = {' ', CELL_DEFAULT_FG, CELL_DEFAULT_BG, 0};
+  int col = 0;
+  const unsigned char *p = NULL;
+  if (n >= 0 && n < scrollback_lines()) {
+    uint32_t where = sb->line_index[(sb->next_seq - 1 - n) % max_lines];
+    p = chunk_data(&sb->chunks[where >> 16]);
+    if (p)
+      p += where & 0xffff;
+  }
+  if (p) {
+    uint16_t hdr[2];
+    memcpy(hdr, p, RECORD_HEADER);
+    const unsigned char *run = p + RECORD_HEADER;
+    const unsigned char *text = run + (size_t)hdr[1] * RUN_SIZE;
+    for (int r = 0; r < hdr[1] && col < cols; r++, run += RUN_SIZE) {
+      uint16_t len, attr;
+      memcpy(&len, run, 2);
+      memcpy(&attr, run + 4, 2);
+      for (int k = 0; k < len && col < cols; k++) {
+        uint32_t ch;
+        text = get_utf8(text, &ch);
+        out[col++] = (Cell){ch, run[2], run[3], attr};
+      }
+    }
+  }
+  while (col < cols)
+    out[col++] = blank_cell;
+}
+
+void scrollback_release(void) {
+  if (compress_chunks)
+    cool(UINT64_MAX);
+}
+
+void scrollback_stats(ScrollbackStats *s) {
+  *s = (ScrollbackStats){0};
+  if (!sb)
+    return; // every session is gone
+  s->lines = scrollback_lines();
+  s->chunks = sb->nchunks;
+  for (int i = 0; i < sb->nchunks; i++) {
+    const Chunk *c = &sb->chunks[(sb->chunk_head + i) % max_chunks];
+    s->logical += c->used;
+    if (c->data)
+      s->resident += CHUNK_SIZE;
+    if (c->packed)
+      s->resident += c->packed_len;
+    if (c->spilled && !c->packed)
+      s->spilled += c->packed_len;
+  }
+  if (sb->spare)
+    s->resident += CHUNK_SIZE;
+}
@@ -0,0 +1,62 @@
+#ifndef SCROLLBACK_H
+#define SCROLLBACK_H
+
+#include "terminal.h"
+
+// Lines that scrolled off the top of the screen. Each line is stored
+// trimmed of trailing blanks as a small record: a list of attribute runs
+// followed by the text as UTF-8. Records are packed into fixed-size
+// chunks that are recycled oldest-first, so pushing a line never
+// allocates and dropping the oldest lines is O(1).
+//
+// MT_SCROLLBACK_LINES (default 10000, 0 disables) and MT_SCROLLBACK_BYTES
+// (default 8 MiB) cap the history; whichever is reached first evicts the
+// oldest chunk.
+//
+// Closed chunks are compressed with lz.c and expanded again only while
+// they are being viewed. Past MT_SCROLLBACK_SPILL bytes of compressed
+// history (default 2 MiB, -1 never), the oldest compressed chunks move to
+// an unlinked temporary file and are mmap'd back when scrolled to.
+// MT_SCROLLBACK_COMPRESS=0 keeps every chunk expanded.
+//
+// Every session has its own history. The functions below work on the one
+// last selected on the calling thread.
+typedef struct Scrollback Scrollback;
+
+// Creates an empty history and selects it.
+Scrollback *scrollback_init(void);
+void scrollback_select(Scrollback *s);
+// Frees the selected history.
+void scrollback_free(void);
+void scrollback_clear(void);
+
+void scrollback_push(const Cell *cells, int cols);
+int scrollback_lines(void);
+// Most lines the history can ever hold.
+int scrollback_capacity(void);
+// Expands line n (0 is the most recent) into cols cells, padding with
+// blanks or cutting off as needed.
+void scrollback_get(int n, Cell *out, int cols);
+// Lines are also numbered by sequence: each pushed line takes the next
+// number and keeps it while newer lines arrive. The history holds
+// scrollback_first_seq() up to scrollback_end_seq() - 1.
+uint64_t scrollback_first_seq(void);
+uint64_t scrollback_end_seq(void);
+// The UTF-8 text of line seq, one codepoint per cell and without trailing
+// blanks; NULL if the line is gone. A cold chunk is expanded into a
+// scratch buffer rather than woken up, so scanning the whole history does
+// not expand all of it. Valid until the next call.
+const char *scrollback_text(uint64_t seq, size_t *len);
+// The view left the history: chunks expanded for it are compressed again.
+void scrollback_release(void);
+
+typedef struct {
+  int lines, chunks;
+  size_t logical;  // bytes of line records stored
+  size_t resident; // heap held: expanded chunks plus compressed copies
+  size_t spilled;  // compressed bytes only in the spill file
+} ScrollbackStats;
+
+void scrollback_stats(ScrollbackStats *s);
+
+#endif // SCROLLBACK_H
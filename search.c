@@ -0,0 +1,432 @@
+#include "search.h"
+#include "latency.h"
+#include "scrollback.h"
+
+#define BLOCK_LINES 1024
+#define MAX_QUERY 256
+// Counting every match of a short query in a long history takes a full
+// scan; the status line counts for this long and then says "n+".
+#define COUNT_BUDGET_NS 8000000
+// Highlight colours: black on yellow, and on orange for the current match.
+#define MATCH_FG ANSI_COLOR_BLACK
+#define MATCH_BG ANSI_COLOR_YELLOW
+#define CURRENT_BG 208
+
+typedef struct {
+  uint32_t line; // seq - base
+  uint16_t off;  // byte offset in the line's text
+} Hit;
+
+// Hits of the query in BLOCK_LINES history lines starting at base. Every
+// start position is kept, overlapping ones included, so the hits of a
+// longer query are always among them.
+typedef struct {
+  uint64_t base;
+  uint32_t gen;      // hits are for this query generation
+  uint32_t qlen;     // query bytes they were checked against
+  uint32_t scanned;  // lines scanned; the newest block keeps growing
+  uint32_t nhits, cap;
+  Hit *hits;
+} Block;
+
+static int active;
+// The session the search was started in. Other sessions, e.g. those of
+// other windows, see no search.
+static Terminal *owner;
+static char query[MAX_QUERY];
+static size_t qlen;
+// Bumped when the query changes other than by growing; blocks of an older
+// generation are rescanned.
+static uint32_t gen = 1;
+static Block *blocks;
+static int nblocks;
+// Where the search stands: the current match, or where the next one is
+// looked for. pos_off is a byte offset in the line's text.
+static uint64_t pos_seq;
+static size_t pos_off;
+static int have_match;
+// Where the search stood before each byte of the query was typed, so
+// deleting it goes back there.
+static struct {
+  uint64_t seq;
+  size_t off;
+} typed_at[MAX_QUERY];
+
+// Scratch for screen rows as text, with trailing blanks trimmed.
+static char *row_text;
+static size_t row_text_cap;
+
+static int before(uint64_t seq, size_t off, uint64_t s, size_t o,
+                  int inclusive) {
+  return seq < s || (seq == s && (off < o || (inclusive && off == o)));
+}
+
+// Next occurrence of the query in t at or after from, or -1.
+static long find(const char *t, size_t len, size_t from) {
+  if (qlen == 0 || len < qlen)
+    return -1;
+  const char *end = t + len - qlen + 1;
+  for (const char *p = t + from; p < end; p++) {
+    p = memchr(p, query[0], end - p);
+    if (!p)
+      return -1;
+    if (memcmp(p + 1, query + 1, qlen - 1) == 0)
+      return p - t;
+  }
+  return -1;
+}
+
+static size_t codepoints(const char *s, size_t n) {
+  size_t count = 0;
+  for (size_t i = 0; i < n; i++)
+    count += ((unsigned char)s[i] & 0xc0) != 0x80;
+  return count;
+}
+
+static char *put_utf8(char *p, uint32_t cp) {
+  if (cp < 0x80) {
+    *p++ = cp;
+  } else if (cp < 0x800) {
+    *p++ = 0xc0 | cp >> 6;
+    *p++ = 0x80 | (cp & 0x3f);
+  } else if (cp < 0x10000) {
+    *p++ = 0xe0 | cp >> 12;
+    *p++ = 0x80 | ((cp >> 6) & 0x3f);
+    *p++ = 0x80 | (cp & 0x3f);
+  } else {
+    *p++ = 0xf0 | cp >> 18;
+    *p++ = 0x80 | ((cp >> 12) & 0x3f);
+    *p++ = 0x80 | ((cp >> 6) & 0x3f);
+    *p++ = 0x80 | (cp & 0x3f);
+  }
+  return p;
+}
+
+static const char *cells_text(const Cell *cells, int cols, size_t *len) {
+  while (cols > 0 && cells[cols - 1].ch == ' ')
+    cols--;
+  size_t need = (size_t)cols * 4;
+  if (need > row_text_cap) {
+    char *buf = realloc(row_text, need);
+    if (!buf)
+      return NULL;
+    row_text = buf;
+    row_text_cap = need;
+  }
+  char *p = row_text;
+  for (int i = 0; i < cols; i++)
+    p = put_utf8(p, cells[i].ch);
+  *len = p - row_text;
+  return row_text;
+}
+
+static const char *line_text(uint64_t seq, size_t *len) {
+  uint64_t end = scrollback_end_seq();
+  if (seq < end)
+    return scrollback_text(seq, len);
+  int row = (int)(seq - end);
+  if (row >= get_terminal_rows())
+    return NULL;
+  return cells_text(terminal_screen_row(row), get_terminal_cols(), len);
+}
+
+static void add_hit(Block *b, uint32_t line, size_t off) {
+  if (b->nhits == b->cap) {
+    uint32_t cap = b->cap ? b->cap * 2 : 16;
+    Hit *hits = realloc(b->hits, cap * sizeof(Hit));
+    if (!hits)
+      return;
+    b->hits = hits;
+    b->cap = cap;
+  }
+  b->hits[b->nhits++] = (Hit){line, (uint16_t)off};
+}
+
+// Drops the hits that the grown query no longer matches.
+static void filter(Block *b) {
+  uint32_t kept = 0;
+  for (uint32_t i = 0; i < b->nhits; i++) {
+    size_t len;
+    const char *t = scrollback_text(b->base + b->hits[i].line, &len);
+    size_t off = b->hits[i].off;
+    if (t && off + qlen <= len && memcmp(t + off, query, qlen) == 0)
+      b->hits[kept++] = b->hits[i];
+  }
+  b->nhits = kept;
+  b->qlen = qlen;
+}
+
+// The hits of block id, bringing them up to date with the query and with
+// lines added since.
+static Block *block(uint64_t id) {
+  Block *b = &blocks[id % nblocks];
+  uint64_t base = id * BLOCK_LINES;
+  if (b->base != base || b->gen != gen) {
+    b->base = base;
+    b->gen = gen;
+    b->qlen = qlen;
+    b->scanned = 0;
+    b->nhits = 0;
+  } else if (b->qlen < qlen) {
+    filter(b);
+  }
+  uint64_t end = scrollback_end_seq();
+  if (end > base + BLOCK_LINES)
+    end = base + BLOCK_LINES;
+  uint64_t seq = base + b->scanned;
+  if (seq < scrollback_first_seq())
+    seq = scrollback_first_seq();
+  for (; seq < end; seq++) {
+    size_t len;
+    const char *t = scrollback_text(seq, &len);
+    for (long off = t ? find(t, len, 0) : -1; off >= 0;
+         off = find(t, len, off + 1))
+      add_hit(b, seq - base, off);
+  }
+  if (end > base + b->scanned)
+    b->scanned = end - base;
+  return b;
+}
+
+// Finds the nearest match before (s, o) going older, or after it going
+// newer. Screen rows are newer than all of the history.
+static int seek(int dir, uint64_t s, size_t o, int inclusive) {
+  uint64_t first = scrollback_first_seq(), end = scrollback_end_seq();
+  uint64_t bottom = end + get_terminal_rows();
+  if (qlen == 0)
+    return 0;
+  if (dir == SEARCH_OLDER) {
+    for (uint64_t seq = s < bottom ? s + 1 : bottom; seq-- > end;) {
+      size_t len;
+      const char *t = line_text(seq, &len);
+      long found = -1;
+      for (long off = t ? find(t, len, 0) : -1; off >= 0;
+           off = find(t, len, off + 1)) {
+        if (!before(seq, off, s, o, inclusive))
+          break;
+        found = off;
+      }
+      if (found >= 0) {
+        pos_seq = seq;
+        pos_off = found;
+        return 1;
+      }
+    }
+    if (end == first)
+      return 0;
+    uint64_t last = (s < end ? s : end - 1) / BLOCK_LINES;
+    for (uint64_t id = last + 1; id-- > first / BLOCK_LINES;) {
+      Block *b = block(id);
+      for (uint32_t i = b->nhits; i-- > 0;) {
+        uint64_t seq = b->base + b->hits[i].line;
+        if (seq < first)
+          break;
+        if (before(seq, b->hits[i].off, s, o, inclusive)) {
+          pos_seq = seq;
+          pos_off = b->hits[i].off;
+          return 1;
+        }
+      }
+    }
+    return 0;
+  }
+
+  if (s < end) {
+    uint64_t from = s < first ? first : s;
+    for (uint64_t id = from / BLOCK_LINES; id <= (end - 1) / BLOCK_LINES;
+         id++) {
+      Block *b = block(id);
+      for (uint32_t i = 0; i < b->nhits; i++) {
+        uint64_t seq = b->base + b->hits[i].line;
+        if (seq >= first && before(s, o, seq, b->hits[i].off, inclusive)) {
+          pos_seq = seq;
+          pos_off = b->hits[i].off;
+          return 1;
+        }
+      }
+    }
+  }
+  for (uint64_t seq = s > end ? s : end; seq < bottom; seq++) {
+    size_t len;
+    const char *t = line_text(seq, &len);
+    for (long off = t ? find(t, len, 0) : -1; off >= 0;
+         off = find(t, len, off + 1)) {
+      if (before(s, o, seq, off, inclusive)) {
+        pos_seq = seq;
+        pos_off = off;
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Scrolls the view so the current match is on screen, near the middle if
+// it has to move.
+static void show_match(void) {
+  uint64_t end = scrollback_end_seq();
+  int rows = get_terminal_rows(), offset = terminal_view_offset();
+  int target;
+  if (pos_seq >= end) {
+    int r = (int)(pos_seq - end);
+    target = r + offset < rows ? offset : 0;
+  } else {
+    int n = (int)(end - 1 - pos_seq); // 0 is the most recent line
+    int row = offset - 1 - n;
+    target = row >= 0 && row < rows ? offset : n + 1 + rows / 2;
+  }
+  terminal_scroll_view(target - offset);
+  terminal_redraw_view();
+}
+
+static int refresh(int inclusive, int dir) {
+  have_match = seek(dir, pos_seq, pos_off, inclusive);
+  if (have_match)
+    show_match();
+  else
+    terminal_redraw_view();
+  return have_match;
+}
+
+void search_start(void) {
+  if (!blocks) {
+    nblocks = scrollback_capacity() / BLOCK_LINES + 2;
+    blocks = calloc(nblocks, sizeof(Block));
+    if (!blocks) {
+      perror("alloc search");
+      return;
+    }
+  }
+  active = 1;
+  owner = terminal_current();
+  qlen = 0;
+  gen++;
+  have_match = 0;
+  // Start below the bottom of the view and look upwards.
+  uint64_t end = scrollback_end_seq();
+  int row = get_terminal_rows() - terminal_view_offset();
+  pos_seq = row >= 0 ? end + row : end - (uint64_t)-row;
+  pos_off = 0;
+}
+
+void search_stop(void) {
+  if (!search_active())
+    return;
+  active = 0;
+  terminal_redraw_view();
+}
+
+int search_active(void) { return active && owner == terminal_current(); }
+
+int search_append(const char *text, size_t len) {
+  if (qlen + len > MAX_QUERY)
+    len = MAX_QUERY - qlen;
+  for (size_t i = 0; i < len; i++) {
+    typed_at[qlen].seq = pos_seq;
+    typed_at[qlen].off = pos_off;
+    query[qlen++] = text[i];
+  }
+  // The current match can stay if it still matches.
+  return refresh(1, SEARCH_OLDER);
+}
+
+int search_backspace(void) {
+  if (qlen == 0)
+    return 0;
+  // Drop a whole UTF-8 sequence.
+  do
+    qlen--;
+  while (qlen > 0 && ((unsigned char)query[qlen] & 0xc0) == 0x80);
+  pos_seq = typed_at[qlen].seq;
+  pos_off = typed_at[qlen].off;
+  gen++;
+  return refresh(1, SEARCH_OLDER);
+}
+
+int search_next(int dir) {
+  if (!have_match)
+    return refresh(1, dir);
+  // Past the last match the current one stays.
+  if (!seek(dir, pos_seq, pos_off, 0))
+    return 0;
+  show_match();
+  return 1;
+}
+
+void search_status(char *buf, size_t size) {
+  if (!have_match) {
+    snprintf(buf, size, "search: %.*s%s", (int)qlen, query,
+             qlen ? "  (no match)" : "");
+    return;
+  }
+  // Matches newer than the current one give its place, counting up from
+  // the bottom. Newest first, so a cut-off count still has it.
+  size_t total = 0, index = 0;
+  uint64_t first = scrollback_first_seq(), end = scrollback_end_seq();
+  for (uint64_t seq = end; seq < end + get_terminal_rows(); seq++) {
+    size_t len;
+    const char *t = line_text(seq, &len);
+    for (long off = t ? find(t, len, 0) : -1; off >= 0;
+         off = find(t, len, off + 1)) {
+      total++;
+      index += before(pos_seq, pos_off, seq, off, 1);
+    }
+  }
+  // Lines from counted_from on have been counted.
+  uint64_t counted_from = end;
+  uint64_t deadline = latency_now() + COUNT_BUDGET_NS;
+  for (uint64_t id = end > first ? (end - 1) / BLOCK_LINES + 1 : 0;
+       id-- > first / BLOCK_LINES;) {
+    if (latency_now() > deadline)
+      break;
+    Block *b = block(id);
+    counted_from = b->base;
+    for (uint32_t i = 0; i < b->nhits; i++) {
+      uint64_t seq = b->base + b->hits[i].line;
+      if (seq < first)
+        continue;
+      total++;
+      index += before(pos_seq, pos_off, seq, b->hits[i].off, 1);
+    }
+  }
+  if (counted_from <= first)
+    snprintf(buf, size, "search: %.*s  [%zu/%zu]", (int)qlen, query, index,
+             total);
+  else if (pos_seq >= counted_from)
+    snprintf(buf, size, "search: %.*s  [%zu/%zu+]", (int)qlen, query, index,
+             total);
+  else
+    snprintf(buf, size, "search: %.*s  [%zu+ matches]", (int)qlen, query,
+             total);
+}
+
+void search_highlight(uint64_t seq, Cell *cells, int cols) {
+  if (!search_active() || qlen == 0)
+    return;
+  size_t len;
+  const char *t = cells_text(cells, cols, &len);
+  if (!t)
+    return;
+  size_t width = codepoints(query, qlen);
+  for (long off = find(t, len, 0); off >= 0; off = find(t, len, off + 1)) {
+    size_t col = codepoints(t, off);
+    int current = have_match && seq == pos_seq && (size_t)off == pos_off;
+    for (size_t k = col; k < col + width && k < (size_t)cols; k++) {
+      cells[k].fg = MATCH_FG;
+      cells[k].bg = current ? CURRENT_BG : MATCH_BG;
+      cells[k].attr &= ~ATTR_REVERSE;
+    }
+  }
+}
+
+void search_free(void) {
+  for (int i = 0; blocks && i < nblocks; i++)
+    free(blocks[i].hits);
+  free(blocks);
+  free(row_text);
+  blocks = NULL;
+  row_text = NULL;
+  row_text_cap = 0;
+  active = 0;
+  owner = NULL;
+}
@@ -0,0 +1,33 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include "terminal.h"
+
+// Incremental search through the scrollback and the screen. Lines are
+// named by sequence number: history lines by scrollback seq, and screen
+// row r by scrollback_end_seq() + r, which stays right as the screen
+// scrolls into the history.
+//
+// Matching is case-sensitive on the UTF-8 text of a line. History is
+// scanned in blocks of lines with memchr on the first byte of the query;
+// each block keeps its hits, and when the query only grows they are
+// filtered instead of rescanned.
+enum { SEARCH_OLDER, SEARCH_NEWER };
+
+void search_start(void);
+void search_stop(void);
+int search_active(void);
+// Edits the query and moves to the nearest match at or above the current
+// one. Returns 1 if a match was found.
+int search_append(const char *text, size_t len);
+int search_backspace(void);
+// Moves to the next match in dir; returns 1 if there was one.
+int search_next(int dir);
+// One-line description of the search for the window title.
+void search_status(char *buf, size_t size);
+void search_free(void);
+
+// Colours the matches in a row about to be drawn.
+void search_highlight(uint64_t seq, Cell *cells, int cols);
+
+#endif // SEARCH_H
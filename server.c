@@ -0,0 +1,275 @@
+// accept4.
+#define _GNU_SOURCE
+#include "server.h"
+#include "latency.h"
+#include "render.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define REQUEST "window\n"
+#define MAX_WAITING 32
+#define MAX_READING 32
+
+static int listen_fd = -1;
+static struct sockaddr_un addr;
+static int server_epfd = -1;
+static uint32_t server_src;
+
+// Clients whose request has not all arrived. They are in the main loop's
+// epoll set until it has.
+static struct {
+  int fd;
+  size_t len;
+  char req[sizeof(REQUEST)];
+  uint64_t start;
+  long start_kib;
+} reading[MAX_READING];
+static int nreading;
+
+// Clients whose window has not drawn its first frame yet.
+static struct {
+  int fd;
+  unsigned window;
+  uint64_t start;
+  long start_kib;
+} waiting[MAX_WAITING];
+static int nwaiting;
+
+static int socket_path(struct sockaddr_un *sa) {
+  memset(sa, 0, sizeof(*sa));
+  sa->sun_family = AF_UNIX;
+  size_t size = sizeof(sa->sun_path);
+  const char *env = getenv("MT_SOCKET");
+  int n;
+  if (env) {
+    n = snprintf(sa->sun_path, size, "%s", env);
+  } else {
+    // One server per display, so the name carries it.
+    char name[64];
+    const char *d = getenv("DISPLAY");
+    snprintf(name, sizeof(name), "%s", d ? d : "");
+    for (char *p = name; *p; p++)
+      if (*p == '/')
+        *p = '_';
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (dir)
+      n = snprintf(sa->sun_path, size, "%s/mt-%s", dir, name);
+    else
+      n = snprintf(sa->sun_path, size, "/tmp/mt-%u-%s", (unsigned)getuid(),
+                   name);
+  }
+  if (n < 0 || (size_t)n >= size) {
+    fprintf(stderr, "Socket path too long\n");
+    return -1;
+  }
+  return 0;
+}
+
+static int connect_server(void) {
+  struct sockaddr_un sa;
+  if (socket_path(&sa) < 0)
+    return -1;
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Resident set size in KiB.
+static long rss_kib(void) {
+  long pages = 0;
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (f) {
+    if (fscanf(f, "%*d %ld", &pages) != 1)
+      pages = 0;
+    fclose(f);
+  }
+  return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void remove_socket(void) {
+  if (listen_fd < 0)
+    return;
+  close(listen_fd);
+  unlink(addr.sun_path);
+  listen_fd = -1;
+}
+
+void server_listen(int epfd, uint32_t src) {
+  if (socket_path(&addr) < 0)
+    exit(EXIT_FAILURE);
+  int fd = connect_server();
+  if (fd >= 0) {
+    fprintf(stderr, "A server is already listening on %s\n", addr.sun_path);
+    exit(EXIT_FAILURE);
+  }
+  // Nobody answered, so a socket that is there is left from a server that
+  // died.
+  unlink(addr.sun_path);
+  listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd < 0) {
+    perror("socket");
+    exit(EXIT_FAILURE);
+  }
+  // Whoever can connect gets a shell as us.
+  mode_t old = umask(077);
+  int err = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(old);
+  if (err < 0 || listen(listen_fd, 16) < 0) {
+    perror(addr.sun_path);
+    exit(EXIT_FAILURE);
+  }
+  atexit(remove_socket);
+  server_epfd = epfd;
+  server_src = src;
+  struct epoll_event ev = {.events = EPOLLIN, .data.u32 = src};
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+    perror("epoll_ctl");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Replies are short and sent once; a client that went away is ignored.
+static void reply(int fd, const char *msg) {
+  if (send(fd, msg, strlen(msg), MSG_NOSIGNAL) < 0 && errno != EPIPE)
+    perror("send");
+  close(fd);
+}
+
+// Reads what has come of client i's request. Returns 1 once it is all
+// there, 0 while more is to come, -1 if it is wrong or the client left.
+static int read_request(int i) {
+  size_t want = sizeof(REQUEST) - 1;
+  ssize_t n = recv(reading[i].fd, reading[i].req + reading[i].len,
+                   want - reading[i].len, 0);
+  if (n < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0
+                                                                     : -1;
+  if (n == 0)
+    return -1;
+  reading[i].len += n;
+  if (memcmp(reading[i].req, REQUEST, reading[i].len) != 0)
+    return -1;
+  return reading[i].len == want;
+}
+
+// A connection stays open until its window is up, so it must not reach
+// the shells forked meanwhile: accepted sockets are close-on-exec.
+void server_handle(void) {
+  int fd;
+  while ((fd = accept4(listen_fd, NULL, NULL,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    if (nreading == MAX_READING) {
+      reply(fd, "error busy\n");
+      continue;
+    }
+    struct epoll_event ev = {.events = EPOLLIN, .data.u32 = server_src};
+    if (epoll_ctl(server_epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      perror("epoll_ctl");
+      close(fd);
+      continue;
+    }
+    reading[nreading].fd = fd;
+    reading[nreading].len = 0;
+    reading[nreading].start = latency_now();
+    reading[nreading].start_kib = rss_kib();
+    nreading++;
+  }
+  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    perror("accept");
+
+  for (int i = 0; i < nreading;) {
+    int r = read_request(i);
+    if (r == 0) {
+      i++;
+      continue;
+    }
+    fd = reading[i].fd;
+    uint64_t start = reading[i].start;
+    long start_kib = reading[i].start_kib;
+    reading[i] = reading[--nreading];
+    // Nothing more is read from it; it is only answered.
+    epoll_ctl(server_epfd, EPOLL_CTL_DEL, fd, NULL);
+    if (r < 0) {
+      reply(fd, "error bad request\n");
+      continue;
+    }
+    unsigned id = nwaiting < MAX_WAITING ? render_open_window() : 0;
+    if (!id) {
+      reply(fd, "error no window\n");
+      continue;
+    }
+    waiting[nwaiting].fd = fd;
+    waiting[nwaiting].window = id;
+    waiting[nwaiting].start = start;
+    waiting[nwaiting].start_kib = start_kib;
+    nwaiting++;
+  }
+}
+
+int server_reply(void) {
+  for (int i = 0; i < nwaiting;) {
+    long frames = render_window_frames(waiting[i].window);
+    if (frames == 0) {
+      i++;
+      continue;
+    }
+    char msg[128];
+    if (frames < 0) {
+      snprintf(msg, sizeof(msg), "error window closed\n");
+    } else {
+      long kib = rss_kib();
+      snprintf(msg, sizeof(msg), "ok %llu %ld %ld %d\n",
+               (unsigned long long)(latency_now() - waiting[i].start) / 1000,
+               kib - waiting[i].start_kib, kib, render_window_count());
+    }
+    reply(waiting[i].fd, msg);
+    waiting[i] = waiting[--nwaiting];
+  }
+  return nwaiting;
+}
+
+int client_request_window(void) {
+  uint64_t start = latency_now();
+  int fd = connect_server();
+  if (fd < 0)
+    return -1;
+  char msg[128];
+  size_t len = 0;
+  ssize_t n = send(fd, REQUEST, sizeof(REQUEST) - 1, MSG_NOSIGNAL);
+  while (n > 0 && len < sizeof(msg) - 1 && !memchr(msg, '\n', len)) {
+    n = read(fd, msg + len, sizeof(msg) - 1 - len);
+    if (n > 0)
+      len += n;
+    else if (n < 0 && errno == EINTR)
+      n = 1;
+  }
+  close(fd);
+  msg[len] = '\0';
+  double total_ms = (latency_now() - start) / 1e6;
+
+  unsigned long long server_us;
+  long window_kib, rss;
+  int windows;
+  if (sscanf(msg, "ok %llu %ld %ld %d", &server_us, &window_kib, &rss,
+             &windows) != 4) {
+    fprintf(stderr, "Server: %s", len ? msg : "no reply\n");
+    return 1;
+  }
+  printf("new window: %.1f ms to first frame (%.1f ms in the server), "
+         "%+ld KiB resident; server %ld KiB for %d window%s\n",
+         total_ms, server_us / 1e3, window_kib, rss, windows,
+         windows == 1 ? "" : "s");
+  return 0;
+}
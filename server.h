@@ -0,0 +1,30 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdint.h>
+
+// Resident mode. "mt -s" keeps one process, with its display connection,
+// font and glyph caches, and a warm shell or two, and opens a window for
+// each "mt -c" that connects to its UNIX socket. The socket is
+// $MT_SOCKET, or mt-<display> in $XDG_RUNTIME_DIR (else /tmp, with the
+// uid in the name).
+//
+// A client is answered once its window has drawn its first frame, with
+// how long that took and how much the window added to the server's
+// resident memory; the client prints both.
+
+// Binds the socket and adds it to epfd with src in data.u32; it is
+// removed at exit. Connections are added to epfd the same way while their
+// request is read. Exits if another server is listening on the socket.
+void server_listen(int epfd, uint32_t src);
+// Accepts clients and reads their requests without blocking, and opens a
+// window for each complete one.
+void server_handle(void);
+// Answers the clients whose window is up. Returns how many still wait.
+int server_reply(void);
+
+// Client side: asks the server for a window and prints the report.
+// Returns -1 if no server is running.
+int client_request_window(void);
+
+#endif // SERVER_H
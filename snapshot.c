@@ -0,0 +1,105 @@
+#include "snapshot.h"
+
+// The snapshot of the window being drawn.
+static Snapshot *snap;
+
+static int words_for(int rows) { return (rows + 63) / 64; }
+
+static void *grow(void *p, size_t size) {
+  void *q = realloc(p, size ? size : 1);
+  if (!q) {
+    perror("alloc snapshot");
+    exit(EXIT_FAILURE);
+  }
+  return q;
+}
+
+static void fit(Snapshot *s, int rows, int cols) {
+  if (s->rows == rows && s->cols == cols)
+    return;
+  s->cells = grow(s->cells, (size_t)rows * cols * sizeof(Cell));
+  s->damage_bits = grow(s->damage_bits, words_for(rows) * sizeof(uint64_t));
+  s->damage_lo = grow(s->damage_lo, rows * sizeof(int));
+  s->damage_hi = grow(s->damage_hi, rows * sizeof(int));
+  s->rows = rows;
+  s->cols = cols;
+}
+
+static void copy_row(Snapshot *s, int r, int c0, int c1) {
+  s->damage_bits[r >> 6] |= 1ull << (r & 63);
+  s->damage_lo[r] = c0;
+  s->damage_hi[r] = c1;
+  memcpy(s->cells + (size_t)r * s->cols, get_terminal_row(r),
+         s->cols * sizeof(Cell));
+}
+
+void snapshot_publish(void) {
+  Snapshot *s = snap;
+  int rows = get_terminal_rows(), cols = get_terminal_cols();
+  // A new size or another session makes every row stale and damaged.
+  int all = rows != s->rows || cols != s->cols || terminal_id() != s->session;
+  fit(s, rows, cols);
+  s->session = terminal_id();
+  memset(s->damage_bits, 0, words_for(rows) * sizeof(uint64_t));
+
+  if (all) {
+    for (int r = 0; r < rows; r++)
+      copy_row(s, r, 0, cols);
+  } else {
+    int c0, c1;
+    for (int r = 0; (r = terminal_next_damaged_row(r, &c0, &c1)) >= 0; r++)
+      if (r < rows)
+        copy_row(s, r, c0, c1);
+  }
+  terminal_clear_damage();
+
+  s->cursor_row = get_cursor_row();
+  s->cursor_col = get_cursor_col();
+  s->cursor_visible = terminal_cursor_visible();
+}
+
+const Snapshot *snapshot_current(void) { return snap; }
+
+int snapshot_next_damaged_row(const Snapshot *s, int from, int *c0, int *c1) {
+  for (int r = from; r < s->rows;) {
+    uint64_t word = s->damage_bits[r >> 6] >> (r & 63);
+    if (!word) {
+      r = (r | 63) + 1;
+      continue;
+    }
+    r += __builtin_ctzll(word);
+    if (r >= s->rows)
+      break;
+    *c0 = s->damage_lo[r];
+    *c1 = s->damage_hi[r] < s->cols ? s->damage_hi[r] : s->cols;
+    return r;
+  }
+  return -1;
+}
+
+const Cell *snapshot_row(const Snapshot *s, int row) {
+  return s->cells + (size_t)row * s->cols;
+}
+
+Snapshot *snapshot_init(void) {
+  Snapshot *s = calloc(1, sizeof(*s));
+  if (!s) {
+    perror("alloc snapshot");
+    exit(EXIT_FAILURE);
+  }
+  snap = s;
+  return s;
+}
+
+void snapshot_select(Snapshot *s) { snap = s; }
+
+void snapshot_free(void) {
+  if (!snap)
+    return;
+  free(snap->cells);
+  free(snap->damage_bits);
+  free(snap->damage_lo);
+  free(snap->damage_hi);
+  free(snap);
+  snap = NULL;
+}
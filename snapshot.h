@@ -0,0 +1,42 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "terminal.h"
+
+// A copy of what the terminal model shows, for the renderer. The copy is
+// made with the session locked, and the renderer draws from it after
+// letting go of the lock, so drawing a frame never holds up the parser.
+// Both happen on the UI thread, one after the other, so a single copy per
+// window is enough and needs no synchronisation of its own.
+//
+// A publish copies only the rows that changed since the previous one, and
+// the snapshot carries that damage for the frame drawn from it.
+//
+// Each window has its own snapshot. The functions below act on the one
+// last passed to snapshot_select, or made by snapshot_init.
+typedef struct {
+  int rows, cols;
+  Cell *cells; // rows * cols
+  uint64_t *damage_bits;
+  int *damage_lo, *damage_hi;
+  int cursor_row, cursor_col, cursor_visible;
+  unsigned session; // the terminal_id the cells were copied from
+} Snapshot;
+
+// Model side: copies what the view shows now and clears the terminal's
+// damage.
+void snapshot_publish(void);
+
+// Renderer side: the last published snapshot.
+const Snapshot *snapshot_current(void);
+// Like terminal_next_damaged_row, for a snapshot.
+int snapshot_next_damaged_row(const Snapshot *s, int from, int *c0, int *c1);
+
+const Cell *snapshot_row(const Snapshot *s, int row);
+
+Snapshot *snapshot_init(void);
+void snapshot_select(Snapshot *s);
+// Frees the selected snapshot.
+void snapshot_free(void);
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,81 @@
+#include "stats.h"
+#include "latency.h"
+#include "render.h"
+#include "terminal.h"
+
+// Rates over less than this are too noisy to show.
+#define MIN_INTERVAL_NS 500000000ull
+
+static Stats last;
+static uint64_t last_ns;
+
+const Stats *stats_sample(void) {
+  uint64_t now = latency_now();
+  if (last_ns && now - last_ns < MIN_INTERVAL_NS)
+    return &last;
+  TerminalCounters t;
+  RenderCounters r;
+  terminal_counters(&t);
+  render_counters(&r);
+
+  Stats s = {.bytes_read = t.bytes_read,
+             .bytes_parsed = t.bytes_parsed,
+             .escapes = t.escapes,
+             .frames = r.frames,
+             .merged = r.merged,
+             .render_mean_us = r.mean_us,
+             .render_p99_us = r.p99_us,
+             .requests_per_frame = r.requests};
+  if (last_ns) {
+    double dt = (now - last_ns) / 1e9;
+    s.seconds = dt;
+    s.read_rate = (s.bytes_read - last.bytes_read) / dt;
+    s.parse_rate = (s.bytes_parsed - last.bytes_parsed) / dt;
+    s.escape_rate = (s.escapes - last.escapes) / dt;
+    s.frame_rate = (s.frames - last.frames) / dt;
+    s.merged_rate = (s.merged - last.merged) / dt;
+  }
+  terminal_memory(&s.grid_bytes, &s.history_bytes);
+  last = s;
+  last_ns = now;
+  return &last;
+}
+
+int stats_overlay(char lines[][STATS_OVERLAY_COLS + 1], int max) {
+  const Stats *s = stats_sample();
+  char text[8][64];
+  snprintf(text[0], 64, "pty read   %9.1f KiB/s", s->read_rate / 1024);
+  snprintf(text[1], 64, "parsed     %9.1f KiB/s", s->parse_rate / 1024);
+  snprintf(text[2], 64, "escapes    %9.0f /s", s->escape_rate);
+  snprintf(text[3], 64, "frames     %5.0f/s skip %5.0f/s", s->frame_rate,
+           s->merged_rate);
+  snprintf(text[4], 64, "render     %6.2f ms p99 %6.2f",
+           s->render_mean_us / 1e3, s->render_p99_us / 1e3);
+  snprintf(text[5], 64, "X requests %9.1f /frame", s->requests_per_frame);
+  snprintf(text[6], 64, "grid       %9.1f KiB", s->grid_bytes / 1024.0);
+  snprintf(text[7], 64, "scrollback %9.1f KiB", s->history_bytes / 1024.0);
+  int n = max < 8 ? max : 8;
+  for (int i = 0; i < n; i++)
+    snprintf(lines[i], STATS_OVERLAY_COLS + 1, "%-*.*s", STATS_OVERLAY_COLS,
+             STATS_OVERLAY_COLS, text[i]);
+  return n;
+}
+
+void stats_write_json(FILE *out) {
+  const Stats *s = stats_sample();
+  fprintf(out,
+          "{\"interval_s\":%.3f,\"pty_bytes_read\":%llu,"
+          "\"pty_read_bps\":%.0f,\"bytes_parsed\":%llu,\"parse_bps\":%.0f,"
+          "\"escapes\":%llu,\"escapes_per_s\":%.0f,\"frames\":%ld,"
+          "\"frames_per_s\":%.1f,\"frames_skipped\":%ld,"
+          "\"frames_skipped_per_s\":%.1f,\"render_mean_us\":%.1f,"
+          "\"render_p99_us\":%.1f,\"x_requests_per_frame\":%.1f,"
+          "\"grid_bytes\":%zu,\"scrollback_bytes\":%zu,\"windows\":%d}\n",
+          s->seconds, (unsigned long long)s->bytes_read, s->read_rate,
+          (unsigned long long)s->bytes_parsed, s->parse_rate,
+          (unsigned long long)s->escapes, s->escape_rate, s->frames,
+          s->frame_rate, s->merged, s->merged_rate, s->render_mean_us,
+          s->render_p99_us, s->requests_per_frame, s->grid_bytes,
+          s->history_bytes, render_window_count());
+  fflush(out);
+}
@@ -0,0 +1,33 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Live performance counters. terminal.c counts what it reads and parses
+// and render.c what it draws; a sample turns the totals into rates over
+// the time since the previous sample. Ctrl+Shift+S shows them in an
+// overlay, and SIGUSR2 prints them as one line of JSON on stdout.
+
+#define STATS_OVERLAY_COLS 32
+
+typedef struct {
+  double seconds; // since the previous sample, 0 for the first
+  uint64_t bytes_read, bytes_parsed, escapes;
+  long frames, merged;
+  // Per second over the interval.
+  double read_rate, parse_rate, escape_rate, frame_rate, merged_rate;
+  double render_mean_us, render_p99_us, requests_per_frame;
+  size_t grid_bytes, history_bytes;
+} Stats;
+
+// Takes a sample, or returns the last one if it is less than half a
+// second old. UI thread only.
+const Stats *stats_sample(void);
+// The overlay text: up to max lines of STATS_OVERLAY_COLS characters,
+// padded with spaces. Returns the number of lines.
+int stats_overlay(char lines[][STATS_OVERLAY_COLS + 1], int max);
+void stats_write_json(FILE *out);
+
+#endif // STATS_H
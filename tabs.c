@@ -0,0 +1,144 @@
+#include "tabs.h"
+#include "render.h"
+#include "search.h"
+#include "terminal.h"
+
+struct Tabs {
+  Terminal **tabs;
+  int ntabs, cap;
+  int current;
+  int rows, cols;
+};
+
+// The tabs of the window being handled.
+static Tabs *tb;
+
+Tabs *tabs_init(int rows, int cols) {
+  Tabs *t = calloc(1, sizeof(*t));
+  if (!t) {
+    perror("alloc tabs");
+    exit(EXIT_FAILURE);
+  }
+  t->current = -1;
+  t->rows = rows;
+  t->cols = cols;
+  tb = t;
+  tabs_new();
+  return t;
+}
+
+void tabs_use(Tabs *t) { tb = t; }
+
+// Shows tab i: a search belongs to the history it was started in, and a
+// tab that was in the background may have missed resizes.
+static void show(int i) {
+  if (search_active()) {
+    search_stop();
+    search_free();
+  }
+  tb->current = i;
+  terminal_select(tb->tabs[i]);
+  terminal_lock();
+  resize_terminal(tb->rows, tb->cols);
+  render_set_title(NULL);
+  render_invalidate();
+}
+
+void tabs_new(void) {
+  if (tb->ntabs == tb->cap) {
+    int cap = tb->cap ? 2 * tb->cap : 8;
+    Terminal **p = realloc(tb->tabs, cap * sizeof(*p));
+    if (!p) {
+      perror("alloc tabs");
+      return;
+    }
+    tb->tabs = p;
+    tb->cap = cap;
+  }
+  Terminal *t = terminal_create(tb->rows, tb->cols);
+  terminal_start_shell();
+  // New tabs open to the right of the visible one.
+  int at = tb->current + 1;
+  memmove(&tb->tabs[at + 1], &tb->tabs[at],
+          (tb->ntabs - at) * sizeof(*tb->tabs));
+  tb->tabs[at] = t;
+  tb->ntabs++;
+  show(at);
+}
+
+static void close_tab(int i) {
+  Terminal *t = tb->tabs[i];
+  memmove(&tb->tabs[i], &tb->tabs[i + 1],
+          (tb->ntabs - i - 1) * sizeof(*tb->tabs));
+  tb->ntabs--;
+  if (i == tb->current) {
+    if (search_active())
+      search_free();
+    terminal_destroy(t);
+    tb->current = -1;
+    if (tb->ntabs > 0)
+      show(i > 0 ? i - 1 : 0);
+    return;
+  }
+  // A background tab: the visible one keeps its lock and stays current.
+  if (i < tb->current)
+    tb->current--;
+  terminal_destroy(t);
+  render_set_title(NULL);
+}
+
+void tabs_close(void) {
+  if (tb->current >= 0)
+    close_tab(tb->current);
+}
+
+void tabs_free(void) {
+  if (!tb)
+    return;
+  if (search_active())
+    search_free();
+  for (int i = 0; i < tb->ntabs; i++)
+    terminal_destroy(tb->tabs[i]);
+  free(tb->tabs);
+  free(tb);
+  tb = NULL;
+}
+
+void tabs_select(int i) {
+  if (i >= 0 && i < tb->ntabs && i != tb->current)
+    show(i);
+}
+
+void tabs_step(int dir) {
+  if (tb->ntabs > 1)
+    show(((tb->current + dir) % tb->ntabs + tb->ntabs) % tb->ntabs);
+}
+
+int tabs_count(void) { return tb ? tb->ntabs : 0; }
+
+int tabs_index(void) { return tb ? tb->current : -1; }
+
+Terminal *tabs_visible(void) {
+  return tb && tb->current >= 0 ? tb->tabs[tb->current] : NULL;
+}
+
+void tabs_resize(int rows, int cols) {
+  tb->rows = rows;
+  tb->cols = cols;
+  if (tb->current >= 0)
+    resize_terminal(rows, cols);
+}
+
+int tabs_poll(void) {
+  int changed = 0;
+  for (int i = tb->ntabs - 1; i >= 0; i--) {
+    int r = terminal_poll(tb->tabs[i]);
+    if (r < 0) {
+      changed |= i == tb->current;
+      close_tab(i);
+    } else if (r > 0 && i == tb->current) {
+      changed = 1;
+    }
+  }
+  return tb->ntabs == 0 ? -1 : changed;
+}
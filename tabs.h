@@ -0,0 +1,39 @@
+#ifndef TABS_H
+#define TABS_H
+
+#include "terminal.h"
+
+// Tabs: the sessions shown in a window, one at a time. Each tab is a
+// terminal session with its own shell; all of them share the window, the
+// X connection and the font. The visible tab is the current session on
+// the UI thread. Tabs in the background keep reading and parsing output,
+// and are fitted to the window size when they are shown again.
+//
+// Every window has its own list. The functions below act on the list last
+// passed to tabs_use, or made by tabs_init.
+typedef struct Tabs Tabs;
+
+// Makes a list with one tab and selects it.
+Tabs *tabs_init(int rows, int cols);
+void tabs_use(Tabs *t);
+// Closes every tab of the selected list and frees it. The visible tab
+// must be the current session.
+void tabs_free(void);
+// Opens a tab with a new shell and shows it.
+void tabs_new(void);
+// Closes the visible tab and shows the one before it.
+void tabs_close(void);
+// Shows tab i, or the one dir tabs along, wrapping around.
+void tabs_select(int i);
+void tabs_step(int dir);
+int tabs_count(void);
+int tabs_index(void);
+Terminal *tabs_visible(void);
+// New size of the window in cells.
+void tabs_resize(int rows, int cols);
+// Takes the sessions' parsed output; terminal_drain_fd is up to the
+// caller. Tabs whose shell exited are closed. Returns 1 if the visible
+// tab changed, -1 once the last tab is gone.
+int tabs_poll(void);
+
+#endif // TABS_H
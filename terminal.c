@@ -1,294 +1,1872 @@
+// posix_openpt and ptsname_r.
+#define _GNU_SOURCE
 #include "terminal.h"
+#include "latency.h"
+#include "ring.h"
+#include "scan.h"
+#include "scrollback.h"
+#include "search.h"
+#include <limits.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <sys/wait.h>
+#include <utmp.h>
 
-static int shell_pid = -1;
-static int pty_fd = -1;
-static char **buffer = NULL;
-static int cursor_row = 0;
-static int cursor_col = 0;
-static int term_rows = 0;
-static int term_cols = 0;
-static char *prompt = NULL;
+// Quiet period after which the local prompt is redrawn once the shell stops
+// producing output.
+#define PROMPT_QUIET_MS 100
+// Bytes buffered per session between the I/O thread and the parser.
+#define PTY_RING_SIZE (1 << 20)
+// A worker parses a session in slices of at most PTY_PARSE_SLICE bytes and
+// moves on once the time budget is spent, so a flood cannot keep it away
+// from other sessions. MT_PARSE_BUDGET_US overrides the budget.
+#define PTY_PARSE_SLICE (64 * 1024)
+#define DEFAULT_PARSE_BUDGET_US 4000
+// Parser workers shared by all sessions; MT_WORKERS overrides the count.
+#define DEFAULT_MAX_WORKERS 4
 
-void write_prompt(void) {
-  if (prompt) {
-    terminal_write(prompt);
+// Cap on bytes waiting for the shell; a paste beyond it is cut short.
+#define WRITE_QUEUE_MAX (64 << 20)
+// A queue grown past this by a large paste is freed once it drains.
+#define WRITE_QUEUE_KEEP (64 * 1024)
+
+// Raw mode: keys go straight to the shell, which echoes them and prints
+// its own prompt.
+static int raw_mode = 0;
+static uint64_t parse_budget_ns = DEFAULT_PARSE_BUDGET_US * 1000ull;
+// Skip plain text that would scroll off before it could be seen
+// (MT_FAST_FORWARD=0 turns it off). Read once, before any worker runs.
+static int fast_forward = 1;
+static const Cell blank_cell = {' ', CELL_DEFAULT_FG, CELL_DEFAULT_BG, 0};
+
+// One session: a shell, its screen, history and parser state.
+struct Terminal {
+  unsigned id; // unique; names the session in the I/O thread's epoll set
+  int shell_pid;
+  int pty_fd;
+  // The shell is to be forked by a worker; input is queued meanwhile.
+  int spawn_pending;
+  // Bytes for the shell: keys, pastes and replies to queries. They are
+  // written without blocking; while some are left, main.c waits for the
+  // PTY to become writable. write_buf[write_off, write_len) is still to go.
+  char *write_buf;
+  size_t write_off, write_len, write_cap;
+  // Bracketed paste (DECSET 2004), and whether the paste in progress was
+  // opened with a bracket.
+  int bracketed_paste;
+  int paste_bracketed;
+  // The screen is one contiguous, cache-aligned array of cells with a row
+  // stride of stride cells. Rows form a ring: logical row r lives at
+  // grid + phys_row(r) * stride, so scrolling moves row_head instead of
+  // copying every row. Cells past cols are kept blank so whole rows can be
+  // compared with memcmp.
+  //
+  // The same slab holds one wrap flag per physical row after the cells:
+  // set when autowrap continued the row's text on the next one, so a
+  // resize can re-wrap the line. A resize fills the spare slab and swaps
+  // the two, so dragging the window only allocates when the screen
+  // outgrows both.
+  Cell *grid;
+  uint8_t *wrapped;
+  size_t grid_cap;
+  Cell *spare_grid;
+  size_t spare_cap;
+  int rows, cols, stride;
+  int row_head;
+  // Attributes applied to newly written cells, as set by SGR sequences.
+  int cur_fg, cur_bg, cur_attr;
+  int cursor_row, cursor_col;
+  int cursor_visible;
+  int app_cursor_keys; // DECCKM
+  // Scrolling region (DECSTBM), inclusive.
+  int scroll_top, scroll_bottom;
+  // Cursor state saved by DECSC / SCOSC.
+  struct {
+    int row, col, fg, bg, attr;
+  } saved;
+  AnsiParser parser;
+  Scrollback *history;
+  // Scrollback viewport: how many history lines the view is scrolled back.
+  // While it is non-zero the view is anchored to the history, so new
+  // output does not move it, and any change repaints the whole view.
+  int view_offset;
+  int view_dirty;
+  // Scratch row for history lines shown in the viewport, and for rows
+  // with search matches coloured in.
+  Cell *view_row;
+  int view_row_cols;
+  // Damage since the renderer last called terminal_clear_damage(): a bit
+  // per logical row plus the half-open range of columns touched in that
+  // row. The arrays only grow, so resizing back and forth reuses them.
+  uint64_t *damage_bits;
+  int *damage_lo, *damage_hi;
+  int damage_cap;
+  char *prompt;
+  InputLine input_line;
+  int prompt_timer_fd;
+  int prompt_pending;
+  _Atomic int prompt_due; // the quiet period ended; the parser redraws it
+
+  // Output path. The I/O thread is the only producer of pty_ring and
+  // whichever worker holds lock the only consumer.
+  ByteRing pty_ring;
+  pthread_mutex_t lock;
+  atomic_int reader_waiting; // ring was full; pty_fd is out of the epoll set
+  atomic_int reader_status;  // 0 running, 1 hangup, 2 read error
+  // Arrival time of the oldest bytes not yet parsed, 0 if none, and of the
+  // oldest parsed since the UI thread last looked.
+  _Atomic uint64_t output_arrival;
+  _Atomic uint64_t parsed_arrival;
+  atomic_int changed; // the screen changed since terminal_poll
+  atomic_int exited;  // the shell is gone and its output parsed
+  // Parse queue links, guarded by queue_lock.
+  Terminal *next_queued;
+  int queued, busy, closing;
+};
+
+// The session the calling thread works on. The UI thread selects the
+// visible tab, and each worker the session it is parsing.
+static __thread Terminal *term;
+// The session the calling thread holds the lock of, if any.
+static __thread Terminal *locked;
+
+static inline int phys_row(int row) {
+  int r = term->row_head + row;
+  return r >= term->rows ? r - term->rows : r;
+}
+
+#define ROW(r) (term->grid + (size_t)phys_row(r) * term->stride)
+
+static inline int clamp(int v, int lo, int hi) {
+  return v < lo ? lo : (v > hi ? hi : v);
+}
+
+static inline Cell make_cell(uint32_t ch) {
+  return (Cell){ch, (uint8_t)term->cur_fg, (uint8_t)term->cur_bg,
+                (uint16_t)term->cur_attr};
+}
+
+static void blank_cells(Cell *cells, int n) {
+  for (int i = 0; i < n; ++i)
+    cells[i] = blank_cell;
+}
+
+static void reset_state(void);
+static void reset_write_queue(void);
+static void fork_pending_shell(void);
+
+static inline void damage(int row, int c0, int c1) {
+  term->damage_bits[row >> 6] |= 1ULL << (row & 63);
+  if (c0 < term->damage_lo[row])
+    term->damage_lo[row] = c0;
+  if (c1 > term->damage_hi[row])
+    term->damage_hi[row] = c1;
+}
+
+static void damage_rows(int r0, int r1) {
+  for (int r = r0; r <= r1; ++r)
+    damage(r, 0, term->cols);
+}
+
+static int alloc_damage(int rows) {
+  int words = (rows + 63) / 64;
+  if (rows > term->damage_cap || !term->damage_bits) {
+    uint64_t *bits = malloc(words * sizeof(uint64_t));
+    int *lo = malloc(rows * sizeof(int));
+    int *hi = malloc(rows * sizeof(int));
+    if (!bits || !lo || !hi) {
+      free(bits);
+      free(lo);
+      free(hi);
+      return -1;
+    }
+    free(term->damage_bits);
+    free(term->damage_lo);
+    free(term->damage_hi);
+    term->damage_bits = bits;
+    term->damage_lo = lo;
+    term->damage_hi = hi;
+    term->damage_cap = rows;
+  }
+  memset(term->damage_bits, 0, words * sizeof(uint64_t));
+  for (int r = 0; r < rows; ++r) {
+    term->damage_lo[r] = INT_MAX;
+    term->damage_hi[r] = 0;
+  }
+  return 0;
+}
+
+static int stride_for(int cols) {
+  return (cols + CELLS_PER_LINE - 1) / CELLS_PER_LINE * CELLS_PER_LINE;
+}
+
+static size_t grid_bytes(int rows, int stride) {
+  return ((size_t)rows * stride * sizeof(Cell) + rows + 63) & ~(size_t)63;
+}
+
+static uint8_t *wrap_flags(Cell *slab, int rows, int stride) {
+  return (uint8_t *)(slab + (size_t)rows * stride);
+}
+
+static Cell *alloc_grid(size_t bytes) {
+  void *cells;
+  if (posix_memalign(&cells, 64, bytes) != 0)
+    return NULL;
+  return cells;
+}
+
+static void blank_grid(void) {
+  blank_cells(term->grid, term->rows * term->stride);
+  memset(term->wrapped, 0, term->rows);
+}
+
+// Output from every session's PTY is read by one I/O thread and parsed by
+// a small pool of workers. The I/O thread watches all PTYs and prompt
+// timers in one epoll set, reads into each session's ring and queues the
+// session. A worker takes the session at the head of the queue, parses one
+// time budget's worth and queues it again at the tail if more is left, so
+// a flooding session takes turns with the others instead of starving them.
+// notify_efd wakes the UI loop after each slice that changed a screen.
+static int io_epfd = -1;
+static int io_wake_efd = -1;
+static int notify_efd = -1;
+static pthread_t io_thread;
+static pthread_t *workers;
+static int nworkers;
+static int threads_running;
+static atomic_int pool_stop;
+// The parse queue, linked through next_queued. A session is in it at most
+// once; busy is set while a worker has it, and idle_cond signals when a
+// worker lets go of one.
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static Terminal *queue_head, *queue_tail;
+// Sessions by id, for the I/O thread's events. The I/O thread holds
+// sessions_lock while it handles a batch, so a session taken out of the
+// list under the lock gets no more reads.
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+static Terminal **sessions;
+static int nsessions, sessions_cap;
+static unsigned next_id = 1;
+// Totals for terminal_counters, over all sessions. Each thread adds once
+// per read or per chunk parsed, so counting costs next to nothing.
+static _Atomic uint64_t bytes_read, bytes_parsed, escapes_seen;
+
+static int grow_sessions(void) {
+  int cap = sessions_cap ? 2 * sessions_cap : 8;
+  pthread_mutex_lock(&sessions_lock);
+  Terminal **p = realloc(sessions, cap * sizeof(*p));
+  if (p) {
+    sessions = p;
+    sessions_cap = cap;
   }
+  pthread_mutex_unlock(&sessions_lock);
+  return p ? 0 : -1;
 }
-static void sigchld_handler(int signo) {
-  int status;
-  pid_t pid = waitpid(shell_pid, &status, WNOHANG);
-  if (pid > 0) {
-    terminal_cleanup();
-    _exit(0);
+
+void write_prompt(void) {
+  if (term->prompt) {
+    terminal_write(term->prompt);
   }
 }
 
-void init_terminal(int rows, int cols) {
-  term_rows = rows;
-  term_cols = cols;
+static void arm_prompt_timer(void) {
+  if (term->prompt_timer_fd < 0 || raw_mode)
+    return;
+  struct itimerspec its = {.it_value = {.tv_sec = 0,
+                                        .tv_nsec = PROMPT_QUIET_MS * 1000000L}};
+  timerfd_settime(term->prompt_timer_fd, 0, &its, NULL);
+  term->prompt_pending = 1;
+}
+static void use(Terminal *t) {
+  term = t;
+  scrollback_select(t ? t->history : NULL);
+}
 
-  buffer = calloc(term_rows, sizeof(char *));
-  if (!buffer) {
-    perror("calloc buffer");
+Terminal *terminal_create(int rows, int cols) {
+  static int configured;
+  if (!configured) {
+    configured = 1;
+    scan_init();
+    const char *budget = getenv("MT_PARSE_BUDGET_US");
+    if (budget && atol(budget) > 0)
+      parse_budget_ns = (uint64_t)atol(budget) * 1000ull;
+    const char *ff = getenv("MT_FAST_FORWARD");
+    if (ff)
+      fast_forward = strcmp(ff, "0") != 0;
+  }
+  Terminal *t = calloc(1, sizeof(Terminal));
+  if (!t || (nsessions == sessions_cap && grow_sessions() < 0)) {
+    perror("alloc terminal");
     exit(EXIT_FAILURE);
   }
-  for (int i = 0; i < term_rows; ++i) {
-    buffer[i] = calloc(term_cols + 1, sizeof(char));
-    if (!buffer[i]) {
-      perror("calloc buffer row");
-      exit(EXIT_FAILURE);
-    }
-    memset(buffer[i], ' ', term_cols);
-    buffer[i][term_cols] = '\0';
+  t->id = next_id++;
+  t->shell_pid = -1;
+  t->pty_fd = -1;
+  t->cursor_visible = 1;
+  pthread_mutex_init(&t->lock, NULL);
+  terminal_select(t);
+
+  term->rows = rows;
+  term->cols = cols;
+  term->stride = stride_for(term->cols);
+  term->grid_cap = grid_bytes(term->rows, term->stride);
+  term->grid = alloc_grid(term->grid_cap);
+  if (!term->grid) {
+    perror("alloc grid");
+    exit(EXIT_FAILURE);
   }
-  cursor_row = cursor_col = 0;
+  term->wrapped = wrap_flags(term->grid, term->rows, term->stride);
+  blank_grid();
+  if (alloc_damage(term->rows) < 0) {
+    perror("alloc damage");
+    exit(EXIT_FAILURE);
+  }
+  ansi_init(&term->parser);
+  term->history = scrollback_init();
+  reset_state();
+
+  term->prompt_timer_fd =
+      timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (term->prompt_timer_fd < 0)
+    perror("timerfd_create");
+
+  pthread_mutex_lock(&sessions_lock);
+  sessions[nsessions++] = t;
+  pthread_mutex_unlock(&sessions_lock);
 
   const char *ps1 = getenv("PS1");
   terminal_set_prompt(ps1 ? ps1 : "$ ");
-  write_prompt();
+  if (!raw_mode)
+    write_prompt();
+  return t;
 }
 
+void terminal_select(Terminal *t) {
+  if (locked && locked != t) {
+    pthread_mutex_unlock(&locked->lock);
+    locked = NULL;
+    if (t) {
+      pthread_mutex_lock(&t->lock);
+      locked = t;
+    }
+  }
+  use(t);
+}
+
+Terminal *terminal_current(void) { return term; }
+
+unsigned terminal_id(void) { return term ? term->id : 0; }
+
+void terminal_lock(void) {
+  if (term && !locked) {
+    pthread_mutex_lock(&term->lock);
+    locked = term;
+  }
+}
+
+void terminal_unlock(void) {
+  if (locked) {
+    pthread_mutex_unlock(&locked->lock);
+    locked = NULL;
+  }
+}
+
+void terminal_set_raw_mode(int on) { raw_mode = on; }
+
+int terminal_raw_mode(void) { return raw_mode; }
+
+InputLine *terminal_input_line(void) { return &term->input_line; }
+
+int terminal_app_cursor_keys(void) { return term->app_cursor_keys; }
+
 void terminal_set_prompt(const char *new_prompt) {
-  free(prompt);
+  free(term->prompt);
   if (new_prompt) {
-    prompt = malloc(strlen(new_prompt) + 1);
-    if (!prompt) {
+    term->prompt = malloc(strlen(new_prompt) + 1);
+    if (!term->prompt) {
       perror("malloc prompt");
       exit(EXIT_FAILURE);
     }
-    strcpy(prompt, new_prompt);
+    strcpy(term->prompt, new_prompt);
   } else {
-    prompt = malloc(1);
-    if (!prompt) {
+    term->prompt = malloc(1);
+    if (!term->prompt) {
       perror("malloc empty prompt");
       exit(EXIT_FAILURE);
     }
-    prompt[0] = '\0';
+    term->prompt[0] = '\0';
   }
 }
 
-const char *terminal_get_prompt(void) { return prompt; }
+const char *terminal_get_prompt(void) { return term->prompt; }
 
-const char **get_terminal_buffer(void) { return (const char **)buffer; }
+const Cell *get_terminal_row(int row) {
+  if (term->view_offset == 0 && !search_active())
+    return ROW(row);
+  if (row >= term->view_offset && !search_active())
+    return ROW(row - term->view_offset);
+  if (term->view_row_cols != term->stride) {
+    Cell *buf = realloc(term->view_row, term->stride * sizeof(Cell));
+    if (!buf)
+      return ROW(row >= term->view_offset ? row - term->view_offset : row);
+    term->view_row = buf;
+    term->view_row_cols = term->stride;
+  }
+  // Screen row r is line scrollback_end_seq() + r; see search.h.
+  uint64_t seq = scrollback_end_seq() + row - term->view_offset;
+  if (row >= term->view_offset)
+    memcpy(term->view_row, ROW(row - term->view_offset),
+           term->stride * sizeof(Cell));
+  else
+    scrollback_get(term->view_offset - 1 - row, term->view_row, term->stride);
+  search_highlight(seq, term->view_row, term->cols);
+  return term->view_row;
+}
+
+const Cell *terminal_screen_row(int row) { return ROW(row); }
+
+void terminal_redraw_view(void) { term->view_dirty = 1; }
+
+void terminal_scroll_view(int lines) {
+  int offset = clamp(term->view_offset + lines, 0, scrollback_lines());
+  if (offset != term->view_offset) {
+    // Back on the live screen: the history viewed can go cold again.
+    if (offset == 0)
+      scrollback_release();
+    term->view_offset = offset;
+    term->view_dirty = 1;
+  }
+}
+
+int terminal_view_offset(void) { return term->view_offset; }
+
+int terminal_next_damaged_row(int from, int *c0, int *c1) {
+  if (term->view_offset > 0 || term->view_dirty) {
+    int any = term->view_dirty;
+    for (int w = 0; !any && w < (term->rows + 63) / 64; w++)
+      any = term->damage_bits[w] != 0;
+    if (!any || from >= term->rows)
+      return -1;
+    *c0 = 0;
+    *c1 = term->cols;
+    return from;
+  }
+  for (int r = from; r < term->rows;) {
+    uint64_t word = term->damage_bits[r >> 6] >> (r & 63);
+    if (!word) {
+      r = (r | 63) + 1;
+      continue;
+    }
+    r += __builtin_ctzll(word);
+    if (r >= term->rows)
+      break;
+    *c0 = term->damage_lo[r];
+    *c1 = term->damage_hi[r] < term->cols ? term->damage_hi[r] : term->cols;
+    return r;
+  }
+  return -1;
+}
+
+void terminal_clear_damage(void) {
+  term->view_dirty = 0;
+  int words = (term->rows + 63) / 64;
+  for (int w = 0; w < words; ++w) {
+    uint64_t word = term->damage_bits[w];
+    while (word) {
+      int r = w * 64 + __builtin_ctzll(word);
+      term->damage_lo[r] = INT_MAX;
+      term->damage_hi[r] = 0;
+      word &= word - 1;
+    }
+    term->damage_bits[w] = 0;
+  }
+}
 
-int get_terminal_rows(void) { return term_rows; }
+int get_terminal_rows(void) { return term->rows; }
 
-int get_terminal_cols(void) { return term_cols; }
+int get_terminal_cols(void) { return term->cols; }
 
+static int blank_at(const Cell *c) {
+  return c->ch == ' ' && c->bg == CELL_DEFAULT_BG && c->attr == 0;
+}
+
+// Walks the old screen as logical lines (rows joined by wrap flags) and
+// re-wraps them at the new width. Each line keeps its text up to the last
+// non-blank cell, or up to the cursor on the cursor's line.
+typedef struct {
+  int row, nrows; // old rows [row, row + nrows)
+  int len;        // cells kept
+} LogicalLine;
+
+static int next_line(int row, int last, LogicalLine *l) {
+  if (row > last)
+    return 0;
+  l->row = row;
+  while (row < last && term->wrapped[phys_row(row)])
+    row++;
+  l->nrows = row - l->row + 1;
+  const Cell *end = ROW(row);
+  int n = term->cols;
+  while (n > 0 && blank_at(&end[n - 1]))
+    n--;
+  l->len = (l->nrows - 1) * term->cols + n;
+  if (term->cursor_row >= l->row && term->cursor_row <= row) {
+    int at = (term->cursor_row - l->row) * term->cols + term->cursor_col;
+    if (at > l->len)
+      l->len = at;
+  }
+  return 1;
+}
+
+static int rows_for(int len, int cols) {
+  return len > 0 ? (len + cols - 1) / cols : 1;
+}
+
+// Copies cells [from, from + n) of logical line l into out.
+static void copy_span(const LogicalLine *l, int from, int n, Cell *out) {
+  while (n > 0) {
+    int r = from / term->cols, c = from % term->cols;
+    int k = term->cols - c < n ? term->cols - c : n;
+    memcpy(out, ROW(l->row + r) + c, k * sizeof(Cell));
+    out += k;
+    from += k;
+    n -= k;
+  }
+}
+
+// Fills dst with the screen re-wrapped to new_rows x new_cols. Rows that no
+// longer fit above the cursor go to the history, as if they had scrolled.
+static void reflow(Cell *dst, int new_rows, int new_cols, int new_stride) {
+  uint8_t *flags = wrap_flags(dst, new_rows, new_stride);
+  int last = term->cursor_row;
+  for (int r = term->rows - 1; r > last; --r) {
+    const Cell *row = ROW(r);
+    int c = 0;
+    while (c < term->cols && blank_at(&row[c]))
+      c++;
+    if (c < term->cols || term->wrapped[phys_row(r - 1)]) {
+      last = r;
+      break;
+    }
+  }
+
+  // First pass: where the cursor lands and how many rows the text needs.
+  LogicalLine l;
+  int total = 0, crow = 0, ccol = 0;
+  for (int r = 0; next_line(r, last, &l); r += l.nrows) {
+    int n = rows_for(l.len, new_cols);
+    if (term->cursor_row >= l.row && term->cursor_row < l.row + l.nrows) {
+      int at = (term->cursor_row - l.row) * term->cols + term->cursor_col;
+      crow = total + at / new_cols;
+      ccol = at % new_cols;
+      // Exactly at the end of a full row: the wrap is still pending.
+      if (crow >= total + n) {
+        crow = total + n - 1;
+        ccol = new_cols;
+      }
+    }
+    total += n;
+  }
+  int skip = total - new_rows;
+  if (skip > crow)
+    skip = crow;
+  if (skip < 0)
+    skip = 0;
+
+  // Second pass: rows before skip are built in dst's first row and pushed
+  // to the history; the rest fill the new screen.
+  blank_cells(dst, new_rows * new_stride);
+  memset(flags, 0, new_rows);
+  int out = 0;
+  for (int r = 0; next_line(r, last, &l); r += l.nrows) {
+    int n = rows_for(l.len, new_cols);
+    for (int i = 0; i < n; ++i, ++out) {
+      int dr = out - skip;
+      if (dr >= new_rows)
+        break;
+      Cell *row = dst + (size_t)(dr < 0 ? 0 : dr) * new_stride;
+      int from = i * new_cols;
+      int k = l.len - from < new_cols ? l.len - from : new_cols;
+      if (k > 0)
+        copy_span(&l, from, k, row);
+      if (dr < 0) {
+        scrollback_push(row, new_cols);
+        blank_cells(row, new_cols);
+      } else {
+        flags[dr] = i < n - 1;
+      }
+    }
+  }
+  term->cursor_row = crow - skip;
+  term->cursor_col = ccol;
+  if (term->cursor_row >= new_rows)
+    term->cursor_row = new_rows - 1;
+  if (term->cursor_col > new_cols)
+    term->cursor_col = new_cols;
+}
+
+// Re-wraps the screen at the new size into the spare slab, so only a size
+// larger than any seen before allocates.
 void resize_terminal(int new_rows, int new_cols) {
-  if (new_rows == term_rows && new_cols == term_cols)
+  if (new_rows == term->rows && new_cols == term->cols)
     return;
 
-  char **new_buf = calloc(new_rows, sizeof(char *));
-  if (!new_buf) {
-    perror("calloc new_buf");
-    return;
-  }
-  for (int i = 0; i < new_rows; ++i) {
-    new_buf[i] = calloc(new_cols + 1, sizeof(char));
-    if (!new_buf[i]) {
-      perror("calloc new_buf row");
-      for (int j = 0; j < i; ++j)
-        free(new_buf[j]);
-      free(new_buf);
+  int new_stride = stride_for(new_cols);
+  size_t need = grid_bytes(new_rows, new_stride);
+  if (term->spare_cap < need) {
+    Cell *cells = alloc_grid(need);
+    if (!cells) {
+      perror("alloc new_grid");
       return;
     }
-    memset(new_buf[i], ' ', new_cols);
-    new_buf[i][new_cols] = '\0';
-  }
-
-  int min_rows = new_rows < term_rows ? new_rows : term_rows;
-  int min_cols = new_cols < term_cols ? new_cols : term_cols;
-  for (int i = 0; i < min_rows; ++i) {
-    memcpy(new_buf[i], buffer[i], min_cols);
-  }
-
-  for (int i = 0; i < term_rows; ++i)
-    free(buffer[i]);
-  free(buffer);
-  buffer = new_buf;
-  term_rows = new_rows;
-  term_cols = new_cols;
-  if (cursor_row >= term_rows)
-    cursor_row = term_rows - 1;
-  if (cursor_col >= term_cols)
-    cursor_col = term_cols - 1;
-
-  if (pty_fd != -1) {
-    struct winsize ws = {.ws_row = term_rows,
-                         .ws_col = term_cols,
+    free(term->spare_grid);
+    term->spare_grid = cells;
+    term->spare_cap = need;
+  }
+  if (alloc_damage(new_rows) < 0) {
+    perror("alloc damage");
+    return;
+  }
+
+  reflow(term->spare_grid, new_rows, new_cols, new_stride);
+  Cell *old = term->grid;
+  size_t old_cap = term->grid_cap;
+  term->grid = term->spare_grid;
+  term->grid_cap = term->spare_cap;
+  term->spare_grid = old;
+  term->spare_cap = old_cap;
+  term->wrapped = wrap_flags(term->grid, new_rows, new_stride);
+  term->row_head = 0;
+  term->rows = new_rows;
+  term->cols = new_cols;
+  term->stride = new_stride;
+  term->scroll_top = 0;
+  term->scroll_bottom = term->rows - 1;
+  term->view_offset = 0;
+  damage_rows(0, term->rows - 1);
+
+  if (term->pty_fd != -1) {
+    struct winsize ws = {.ws_row = term->rows,
+                         .ws_col = term->cols,
                          .ws_xpixel = 0,
                          .ws_ypixel = 0};
-    ioctl(pty_fd, TIOCSWINSZ, &ws);
+    ioctl(term->pty_fd, TIOCSWINSZ, &ws);
   }
 }
 
 void terminal_clear(void) {
-  for (int i = 0; i < term_rows; ++i) {
-    memset(buffer[i], ' ', term_cols);
-  }
-  cursor_row = cursor_col = 0;
+  blank_grid();
+  damage_rows(0, term->rows - 1);
+  term->cursor_row = term->cursor_col = 0;
   write_prompt();
 }
 
-void terminal_write(const char *text) {
-  for (size_t i = 0; text[i]; ++i) {
-    char c = text[i];
-    if (c == '\033') {
-      // Handle ANSI escape sequences if necessary
-      char seq[32] = {0};
-      size_t j = 0;
-      seq[j++] = c;
-      while (text[i + 1] && j < sizeof(seq) - 1) {
-        seq[j++] = text[++i];
-        if ((seq[j - 1] >= 'A' && seq[j - 1] <= 'Z') ||
-            (seq[j - 1] >= 'a' && seq[j - 1] <= 'z')) {
-          break;
-        }
-      }
-      seq[j] = '\0';
-      // Handle escape sequence parsing
-    } else if (c == '\n') {
-      cursor_row++;
-      cursor_col = 0;
-      if (cursor_row >= term_rows) {
-        // Handle scrolling behavior
-        for (int r = 0; r < term_rows - 1; ++r)
-          memcpy(buffer[r], buffer[r + 1], term_cols);
-        memset(buffer[term_rows - 1], ' ', term_cols);
-        cursor_row = term_rows - 1;
-      }
-    } else if (c == '\r') {
-      cursor_col = 0;
-    } else if (c == '\b' || c == 127) {
-      if (cursor_col > 0) {
-        cursor_col--;
-        buffer[cursor_row][cursor_col] = ' ';
-      }
-    } else {
-      if (cursor_col >= term_cols) {
-        cursor_row++;
-        cursor_col = 0;
-      }
-      if (cursor_row >= term_rows) {
-        for (int r = 0; r < term_rows - 1; ++r)
-          memcpy(buffer[r], buffer[r + 1], term_cols);
-        memset(buffer[term_rows - 1], ' ', term_cols);
-        cursor_row = term_rows - 1;
-      }
-      buffer[cursor_row][cursor_col++] = c;
+// Cells cleared by erase and scroll operations take the current background
+// (xterm's back-colour-erase, which the xterm-256color terminfo advertises).
+static inline Cell erase_cell(void) {
+  return (Cell){' ', CELL_DEFAULT_FG, (uint8_t)term->cur_bg, 0};
+}
+
+static void erase_span(int row, int col, int n) {
+  Cell blank = erase_cell();
+  Cell *cells = ROW(row) + col;
+  for (int i = 0; i < n; ++i)
+    cells[i] = blank;
+  if (col + n >= term->cols)
+    term->wrapped[phys_row(row)] = 0;
+  damage(row, col, col + n);
+}
+
+// Rows scrolled off the top of the screen go to the history.
+static void push_history(int row) {
+  scrollback_push(ROW(row), term->cols);
+  if (term->view_offset > 0) {
+    term->view_offset = clamp(term->view_offset + 1, 0, scrollback_lines());
+    term->view_dirty = 1;
+  }
+}
+
+// Scrolls rows top..bottom up by n. A full-screen scroll only moves the
+// ring head; a partial region has to move the rows in between.
+static void scroll_region_up(int top, int bottom, int n) {
+  n = clamp(n, 0, bottom - top + 1);
+  if (top == 0 && bottom == term->rows - 1) {
+    for (int i = 0; i < n; ++i) {
+      push_history(0);
+      erase_span(0, 0, term->cols);
+      term->row_head = phys_row(1);
+    }
+    damage_rows(0, term->rows - 1);
+    return;
+  }
+  for (int r = 0; top == 0 && r < n; ++r)
+    push_history(r);
+  for (int r = top; r + n <= bottom; ++r) {
+    memcpy(ROW(r), ROW(r + n), term->stride * sizeof(Cell));
+    term->wrapped[phys_row(r)] = term->wrapped[phys_row(r + n)];
+  }
+  for (int r = bottom - n + 1; r <= bottom; ++r)
+    erase_span(r, 0, term->cols);
+  damage_rows(top, bottom);
+}
+
+static void scroll_region_down(int top, int bottom, int n) {
+  n = clamp(n, 0, bottom - top + 1);
+  if (top == 0 && bottom == term->rows - 1) {
+    for (int i = 0; i < n; ++i) {
+      term->row_head = phys_row(term->rows - 1);
+      erase_span(0, 0, term->cols);
     }
+    damage_rows(0, term->rows - 1);
+    return;
+  }
+  for (int r = bottom; r - n >= top; --r) {
+    memcpy(ROW(r), ROW(r - n), term->stride * sizeof(Cell));
+    term->wrapped[phys_row(r)] = term->wrapped[phys_row(r - n)];
+  }
+  for (int r = top; r < top + n; ++r)
+    erase_span(r, 0, term->cols);
+  damage_rows(top, bottom);
+}
+
+static void line_feed(void) {
+  if (term->cursor_row == term->scroll_bottom)
+    scroll_region_up(term->scroll_top, term->scroll_bottom, 1);
+  else if (term->cursor_row < term->rows - 1)
+    term->cursor_row++;
+}
+
+static void reverse_index(void) {
+  if (term->cursor_row == term->scroll_top)
+    scroll_region_down(term->scroll_top, term->scroll_bottom, 1);
+  else if (term->cursor_row > 0)
+    term->cursor_row--;
+}
+
+// cursor_col == cols means a wrap is pending: the next printable
+// character goes to the start of the following line.
+static void put_char(uint32_t ch) {
+  if (term->cursor_col >= term->cols) {
+    term->wrapped[phys_row(term->cursor_row)] = 1;
+    term->cursor_col = 0;
+    line_feed();
   }
+  damage(term->cursor_row, term->cursor_col, term->cursor_col + 1);
+  ROW(term->cursor_row)[term->cursor_col++] = make_cell(ch);
+}
+
+// Writes a run of printable ASCII starting at the cursor, wrapping at the
+// right margin. Equivalent to put_char() per byte, one row span at a time.
+static void put_ascii_run(const unsigned char *s, size_t n) {
+  Cell tmpl = make_cell(0);
+  uint64_t high;
+  memcpy(&high, &tmpl, sizeof(high));
+  while (n > 0) {
+    if (term->cursor_col >= term->cols) {
+      term->wrapped[phys_row(term->cursor_row)] = 1;
+      term->cursor_col = 0;
+      line_feed();
+    }
+    size_t chunk = (size_t)(term->cols - term->cursor_col);
+    if (chunk > n)
+      chunk = n;
+    scan_expand((uint64_t *)(ROW(term->cursor_row) + term->cursor_col), s,
+                chunk, high);
+    damage(term->cursor_row, term->cursor_col, term->cursor_col + (int)chunk);
+    term->cursor_col += (int)chunk;
+    s += chunk;
+    n -= chunk;
+  }
+}
+
+// Replies are queued behind any pending input so the order is kept.
+static void pty_reply(const char *s) { terminal_send(s, strlen(s)); }
+
+static void save_cursor(void) {
+  term->saved.row = term->cursor_row;
+  term->saved.col = term->cursor_col;
+  term->saved.fg = term->cur_fg;
+  term->saved.bg = term->cur_bg;
+  term->saved.attr = term->cur_attr;
+}
+
+static void restore_cursor(void) {
+  term->cursor_row = clamp(term->saved.row, 0, term->rows - 1);
+  term->cursor_col = clamp(term->saved.col, 0, term->cols - 1);
+  term->cur_fg = term->saved.fg;
+  term->cur_bg = term->saved.bg;
+  term->cur_attr = term->saved.attr;
+}
+
+static void reset_state(void) {
+  term->cur_fg = CELL_DEFAULT_FG;
+  term->cur_bg = CELL_DEFAULT_BG;
+  term->cur_attr = 0;
+  term->scroll_top = 0;
+  term->scroll_bottom = term->rows - 1;
+  term->cursor_visible = 1;
+  term->app_cursor_keys = 0;
+  term->bracketed_paste = 0;
+  term->cursor_row = term->cursor_col = 0;
+  save_cursor();
 }
 
-void terminal_read_output(void) {
-  if (pty_fd < 0)
+static void execute(uint32_t c) {
+  switch (c) {
+  case '\n':
+  case '\v':
+  case '\f':
+    term->cursor_col = 0;
+    line_feed();
+    break;
+  case '\r':
+    term->cursor_col = 0;
+    break;
+  case '\b':
+    if (term->cursor_col >= term->cols)
+      term->cursor_col = term->cols - 1;
+    if (term->cursor_col > 0)
+      term->cursor_col--;
+    break;
+  case '\t':
+    if (term->cursor_col < term->cols)
+      term->cursor_col = (term->cursor_col / 8 + 1) * 8;
+    if (term->cursor_col > term->cols - 1)
+      term->cursor_col = term->cols - 1;
+    break;
+  }
+}
+
+static void esc_dispatch(const AnsiParser *p) {
+  if (p->nintermediates > 0)
+    return; // character set designations and the like
+  switch (p->ch) {
+  case '7':
+    save_cursor();
+    break;
+  case '8':
+    restore_cursor();
+    break;
+  case 'D':
+    line_feed();
+    break;
+  case 'E':
+    term->cursor_col = 0;
+    line_feed();
+    break;
+  case 'M':
+    reverse_index();
+    break;
+  case 'c':
+    reset_state();
+    blank_grid();
+    damage_rows(0, term->rows - 1);
+    break;
+  }
+}
+
+static void set_private_mode(const AnsiParser *p, int on) {
+  for (int i = 0; i < p->nparams; i++) {
+    switch (p->params[i]) {
+    case 1:
+      term->app_cursor_keys = on;
+      break;
+    case 25:
+      term->cursor_visible = on;
+      break;
+    case 2004:
+      term->bracketed_paste = on;
+      break;
+    }
+  }
+}
+
+static void erase_display(int mode) {
+  switch (mode) {
+  case 0:
+    erase_span(term->cursor_row, term->cursor_col,
+               term->cols - term->cursor_col);
+    for (int r = term->cursor_row + 1; r < term->rows; ++r)
+      erase_span(r, 0, term->cols);
+    break;
+  case 1:
+    for (int r = 0; r < term->cursor_row; ++r)
+      erase_span(r, 0, term->cols);
+    erase_span(term->cursor_row, 0, term->cursor_col + 1);
+    break;
+  case 2:
+    for (int r = 0; r < term->rows; ++r)
+      erase_span(r, 0, term->cols);
+    break;
+  case 3:
+    scrollback_clear();
+    term->view_offset = 0;
+    damage_rows(0, term->rows - 1);
+    break;
+  }
+}
+
+static void erase_line(int mode) {
+  switch (mode) {
+  case 0:
+    erase_span(term->cursor_row, term->cursor_col,
+               term->cols - term->cursor_col);
+    break;
+  case 1:
+    erase_span(term->cursor_row, 0, term->cursor_col + 1);
+    break;
+  case 2:
+    erase_span(term->cursor_row, 0, term->cols);
+    break;
+  }
+}
+
+static void csi_dispatch(const AnsiParser *p) {
+  // The cursor may sit one past the last column while a wrap is pending.
+  if (term->cursor_col >= term->cols)
+    term->cursor_col = term->cols - 1;
+  int n = ansi_param(p, 0, 1);
+  Cell *row = ROW(term->cursor_row);
+
+  if (p->prefix == '?') {
+    if (p->ch == 'h' || p->ch == 'l')
+      set_private_mode(p, p->ch == 'h');
     return;
-  char buf[1024];
-  struct pollfd pfd = {.fd = pty_fd, .events = POLLIN};
-  while (poll(&pfd, 1, 100) > 0) {
-    if (pfd.revents & POLLIN) {
-      ssize_t n = read(pty_fd, buf, sizeof(buf) - 1);
-      if (n > 0) {
-        buf[n] = '\0';
-        terminal_write(buf);
-      } else if (n == 0) {
-        close(pty_fd);
-        pty_fd = -1;
-        shell_pid = -1;
-        terminal_write("\nShell terminated\n");
-        terminal_cleanup();
-        exit(0);
-      } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
-        perror("read shell");
-        close(pty_fd);
-        pty_fd = -1;
-        shell_pid = -1;
-        terminal_write("\nError reading shell\n");
-        write_prompt();
-        return;
+  }
+  if (p->prefix || p->nintermediates)
+    return;
+
+  switch (p->ch) {
+  case 'A':
+    term->cursor_row = clamp(term->cursor_row - n, 0, term->rows - 1);
+    break;
+  case 'B':
+  case 'e':
+    term->cursor_row = clamp(term->cursor_row + n, 0, term->rows - 1);
+    break;
+  case 'C':
+  case 'a':
+    term->cursor_col = clamp(term->cursor_col + n, 0, term->cols - 1);
+    break;
+  case 'D':
+    term->cursor_col = clamp(term->cursor_col - n, 0, term->cols - 1);
+    break;
+  case 'E':
+    term->cursor_row = clamp(term->cursor_row + n, 0, term->rows - 1);
+    term->cursor_col = 0;
+    break;
+  case 'F':
+    term->cursor_row = clamp(term->cursor_row - n, 0, term->rows - 1);
+    term->cursor_col = 0;
+    break;
+  case 'G':
+  case '`':
+    term->cursor_col = clamp(n - 1, 0, term->cols - 1);
+    break;
+  case 'd':
+    term->cursor_row = clamp(n - 1, 0, term->rows - 1);
+    break;
+  case 'H':
+  case 'f':
+    term->cursor_row = clamp(n - 1, 0, term->rows - 1);
+    term->cursor_col = clamp(ansi_param(p, 1, 1) - 1, 0, term->cols - 1);
+    break;
+  case 'J':
+    erase_display(ansi_param(p, 0, 0));
+    break;
+  case 'K':
+    erase_line(ansi_param(p, 0, 0));
+    break;
+  case 'X':
+    erase_span(term->cursor_row, term->cursor_col,
+               clamp(n, 0, term->cols - term->cursor_col));
+    break;
+  case '@':
+    n = clamp(n, 0, term->cols - term->cursor_col);
+    memmove(row + term->cursor_col + n, row + term->cursor_col,
+            (term->cols - term->cursor_col - n) * sizeof(Cell));
+    damage(term->cursor_row, term->cursor_col, term->cols);
+    erase_span(term->cursor_row, term->cursor_col, n);
+    break;
+  case 'P':
+    n = clamp(n, 0, term->cols - term->cursor_col);
+    memmove(row + term->cursor_col, row + term->cursor_col + n,
+            (term->cols - term->cursor_col - n) * sizeof(Cell));
+    damage(term->cursor_row, term->cursor_col, term->cols);
+    erase_span(term->cursor_row, term->cols - n, n);
+    break;
+  case 'L':
+    if (term->cursor_row >= term->scroll_top &&
+        term->cursor_row <= term->scroll_bottom)
+      scroll_region_down(term->cursor_row, term->scroll_bottom, n);
+    break;
+  case 'M':
+    if (term->cursor_row >= term->scroll_top &&
+        term->cursor_row <= term->scroll_bottom)
+      scroll_region_up(term->cursor_row, term->scroll_bottom, n);
+    break;
+  case 'S':
+    scroll_region_up(term->scroll_top, term->scroll_bottom, n);
+    break;
+  case 'T':
+    scroll_region_down(term->scroll_top, term->scroll_bottom, n);
+    break;
+  case 'r': {
+    int top = ansi_param(p, 0, 1) - 1;
+    int bottom = ansi_param(p, 1, term->rows) - 1;
+    if (top < bottom && bottom < term->rows) {
+      term->scroll_top = top;
+      term->scroll_bottom = bottom;
+      term->cursor_row = term->cursor_col = 0;
+    }
+    break;
+  }
+  case 'm':
+    ansi_sgr(p->params, p->nparams, &term->cur_fg, &term->cur_bg,
+             &term->cur_attr);
+    break;
+  case 's':
+    save_cursor();
+    break;
+  case 'u':
+    restore_cursor();
+    break;
+  case 'n':
+    if (ansi_param(p, 0, 0) == 5) {
+      pty_reply("\033[0n");
+    } else if (ansi_param(p, 0, 0) == 6) {
+      char reply[32];
+      snprintf(reply, sizeof(reply), "\033[%d;%dR", term->cursor_row + 1,
+               term->cursor_col + 1);
+      pty_reply(reply);
+    }
+    break;
+  case 'c':
+    pty_reply("\033[?6c");
+    break;
+  }
+}
+
+void terminal_write(const char *text) { terminal_feed(text, strlen(text)); }
+
+// Fast-forward. Plain text (printable ASCII, CR, LF, TAB, BS) only writes
+// cells and scrolls. With a full-screen scroll region and the cursor on
+// the bottom row, every line feed scrolls, so the text after the last
+// rows + 1 line feeds starts at column 0 of the bottom row and then feeds
+// rows lines, which scrolls away every row it did not write. So the
+// screen afterwards does not depend on anything before it, and the bytes
+// before it can be skipped. Higher up, the line feeds would first move
+// the cursor down over rows that are never scrolled away, so nothing is
+// skipped until the cursor reaches the bottom. Lines that the history
+// still has room for are kept, so it is rows plus the scrollback
+// capacity. Returns the number of bytes to skip.
+static size_t skippable_prefix(const unsigned char *s, size_t len) {
+  int keep = term->rows + scrollback_capacity();
+  if (!fast_forward || !ansi_in_ground(&term->parser) ||
+      term->scroll_top != 0 || term->scroll_bottom != term->rows - 1 ||
+      term->cursor_row != term->rows - 1 || len < 2 * (size_t)(keep + 1))
+    return 0;
+  size_t plain = 0;
+  while (plain < len) {
+    plain += scan_printable(s + plain, len - plain);
+    if (plain < len && (s[plain] == '\n' || s[plain] == '\r' ||
+                        s[plain] == '\t' || s[plain] == '\b'))
+      plain++;
+    else
+      break;
+  }
+  // Walk back over keep + 1 line feeds.
+  size_t end = plain;
+  for (int lines = 0; lines <= keep; lines++) {
+    do {
+      if (end == 0)
+        return 0;
+    } while (s[--end] != '\n');
+  }
+  return end + 1;
+}
+
+static void feed(const unsigned char *s, size_t len) {
+  uint64_t sequences = 0;
+  for (size_t i = 0; i < len; ++i) {
+    // Fast path: plain printable ASCII in the ground state bypasses the
+    // state machine and is copied into the row in bulk.
+    if (s[i] >= 0x20 && s[i] < 0x7f && ansi_in_ground(&term->parser)) {
+      size_t run = scan_printable(s + i, len - i);
+      put_ascii_run(s + i, run);
+      i += run - 1;
+      continue;
+    }
+    switch (ansi_step(&term->parser, s[i])) {
+    case ANSI_NONE:
+      break;
+    case ANSI_PRINT:
+      put_char(term->parser.ch);
+      break;
+    case ANSI_EXECUTE:
+      execute(term->parser.ch);
+      break;
+    case ANSI_ESC_DISPATCH:
+      esc_dispatch(&term->parser);
+      sequences++;
+      break;
+    case ANSI_CSI_DISPATCH:
+      csi_dispatch(&term->parser);
+      sequences++;
+      break;
+    case ANSI_OSC_DISPATCH:
+      sequences++;
+      break;
+    }
+  }
+  if (sequences)
+    atomic_fetch_add_explicit(&escapes_seen, sequences, memory_order_relaxed);
+}
+
+void terminal_feed(const char *text, size_t len) {
+  const unsigned char *s = (const unsigned char *)text;
+  size_t skip = skippable_prefix(s, len);
+  if (skip > 0)
+    term->cursor_col = 0;
+  feed(s + skip, len - skip);
+}
+
+static void efd_signal(int fd) {
+  uint64_t one = 1;
+  if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    perror("eventfd write");
+}
+
+static void efd_drain(int fd) {
+  uint64_t count;
+  while (read(fd, &count, sizeof(count)) == sizeof(count))
+    ;
+}
+
+// epoll data for the I/O thread: session id << 1, low bit set for the
+// prompt timer. Id 0 is the wake eventfd.
+static void io_watch(Terminal *t, int fd, int timer) {
+  struct epoll_event ev = {.events = EPOLLIN,
+                           .data.u64 = (uint64_t)t->id << 1 | timer};
+  if (epoll_ctl(io_epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    perror("epoll_ctl");
+}
+
+static void io_unwatch(int fd) {
+  if (fd >= 0)
+    epoll_ctl(io_epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+// Called with queue_lock held.
+static void enqueue(Terminal *t) {
+  if (t->queued || t->closing)
+    return;
+  t->queued = 1;
+  t->next_queued = NULL;
+  if (queue_tail)
+    queue_tail->next_queued = t;
+  else
+    queue_head = t;
+  queue_tail = t;
+  pthread_cond_signal(&queue_cond);
+}
+
+static void unqueue(Terminal *t) {
+  Terminal **p = &queue_head, *prev = NULL;
+  while (*p && *p != t) {
+    prev = *p;
+    p = &(*p)->next_queued;
+  }
+  if (!*p)
+    return;
+  *p = t->next_queued;
+  if (queue_tail == t)
+    queue_tail = prev;
+  t->queued = 0;
+}
+
+// Reads what the PTY has into the ring; returns 1 if the session has
+// something for a worker.
+static int io_read(Terminal *t) {
+  unsigned char *span;
+  size_t space = ring_write_span(&t->pty_ring, &span);
+  if (space == 0) {
+    // Backpressure: drop the PTY from the set until a worker frees some
+    // room. The flag is set before re-checking so a concurrent consume
+    // cannot slip between the check and the removal without re-adding it.
+    ring_note_full(&t->pty_ring);
+    io_unwatch(t->pty_fd);
+    atomic_store(&t->reader_waiting, 1);
+    if (ring_write_span(&t->pty_ring, &span) > 0 &&
+        atomic_exchange(&t->reader_waiting, 0))
+      io_watch(t, t->pty_fd, 0);
+    return 1;
+  }
+  ssize_t n = read(t->pty_fd, span, space);
+  if (n > 0) {
+    ring_commit(&t->pty_ring, (size_t)n);
+    atomic_fetch_add_explicit(&bytes_read, n, memory_order_relaxed);
+    uint64_t none = 0;
+    atomic_compare_exchange_strong(&t->output_arrival, &none, latency_now());
+    return 1;
+  }
+  if (n == 0 || errno == EIO) {
+    // Linux reports EIO on the master once the slave side is gone.
+    atomic_store(&t->reader_status, 1);
+  } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+    atomic_store(&t->reader_status, 2);
+  } else {
+    return 0;
+  }
+  io_unwatch(t->pty_fd);
+  return 1;
+}
+
+static void *io_main(void *arg) {
+  (void)arg;
+  struct epoll_event events[16];
+  while (!atomic_load(&pool_stop)) {
+    int n = epoll_wait(io_epfd, events, 16, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      break;
+    }
+    pthread_mutex_lock(&sessions_lock);
+    for (int i = 0; i < n; i++) {
+      unsigned id = events[i].data.u64 >> 1;
+      if (id == 0) {
+        efd_drain(io_wake_efd);
+        continue;
+      }
+      Terminal *t = NULL;
+      for (int k = 0; k < nsessions && !t; k++)
+        if (sessions[k]->id == id)
+          t = sessions[k];
+      if (!t)
+        continue;
+      int ready;
+      if (events[i].data.u64 & 1) {
+        uint64_t expirations;
+        ready = read(t->prompt_timer_fd, &expirations, sizeof(expirations)) ==
+                sizeof(expirations);
+        if (ready)
+          atomic_store(&t->prompt_due, 1);
       } else {
-        break;
+        ready = io_read(t);
       }
+      if (ready) {
+        pthread_mutex_lock(&queue_lock);
+        enqueue(t);
+        pthread_mutex_unlock(&queue_lock);
+      }
+    }
+    pthread_mutex_unlock(&sessions_lock);
+  }
+  return NULL;
+}
+
+// Parses the current session's output for at most one time budget.
+// Returns 1 if some is left over.
+static int parse_slice(void) {
+  uint64_t arrival = atomic_exchange(&term->output_arrival, 0);
+  int total = 0;
+  if (term->spawn_pending) {
+    fork_pending_shell();
+    total++;
+  }
+  if (atomic_exchange(&term->prompt_due, 0) && term->prompt_pending) {
+    term->prompt_pending = 0;
+    write_prompt();
+    total++;
+  }
+
+  const unsigned char *span;
+  size_t n, parsed = 0;
+  uint64_t start = latency_now();
+  while ((n = ring_read_span(&term->pty_ring, &span)) > 0) {
+    // Fast-forward looks at all the buffered output, not just one slice.
+    size_t skip = skippable_prefix(span, n);
+    if (skip > 0) {
+      term->cursor_col = 0;
+      ring_consume(&term->pty_ring, skip);
+      total += skip;
+      parsed += skip;
+      continue;
+    }
+    if (n > PTY_PARSE_SLICE)
+      n = PTY_PARSE_SLICE;
+    feed(span, n);
+    ring_consume(&term->pty_ring, n);
+    total += n;
+    parsed += n;
+    if (atomic_exchange(&term->reader_waiting, 0))
+      io_watch(term, term->pty_fd, 0);
+    if (latency_now() - start >= parse_budget_ns)
+      break;
+  }
+  atomic_fetch_add_explicit(&bytes_parsed, parsed, memory_order_relaxed);
+  if (total > 0 && term->prompt_pending)
+    arm_prompt_timer();
+  // Bytes left over keep their arrival time for a later slice; once all
+  // is parsed, it is handed to the UI thread for its latency histogram.
+  int more = ring_used(&term->pty_ring) > 0;
+  uint64_t none = 0;
+  if (arrival)
+    atomic_compare_exchange_strong(more ? &term->output_arrival
+                                        : &term->parsed_arrival,
+                                   &none, arrival);
+
+  int status = atomic_load(&term->reader_status);
+  if (status != 0 && !more && term->pty_fd >= 0) {
+    close(term->pty_fd);
+    term->pty_fd = -1;
+    reset_write_queue();
+    if (term->shell_pid > 0) {
+      kill(term->shell_pid, SIGHUP);
+      waitpid(term->shell_pid, NULL, 0);
+    }
+    term->shell_pid = -1;
+    if (status == 1) {
+      atomic_store(&term->exited, 1);
     } else {
+      terminal_write("\nError reading shell\n");
+      write_prompt();
+    }
+    total++;
+  }
+  // Replies to queries from a tab in the background go out here; the UI
+  // thread only flushes the visible one.
+  terminal_flush_input();
+  if (total > 0) {
+    atomic_store(&term->changed, 1);
+    efd_signal(notify_efd);
+  }
+  return more;
+}
+
+static void *worker_main(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&queue_lock);
+  for (;;) {
+    while (!queue_head && !atomic_load(&pool_stop))
+      pthread_cond_wait(&queue_cond, &queue_lock);
+    if (atomic_load(&pool_stop))
       break;
+    Terminal *t = queue_head;
+    unqueue(t);
+    t->busy = 1;
+    pthread_mutex_unlock(&queue_lock);
+
+    pthread_mutex_lock(&t->lock);
+    use(t);
+    int more = parse_slice();
+    use(NULL);
+    pthread_mutex_unlock(&t->lock);
+
+    pthread_mutex_lock(&queue_lock);
+    t->busy = 0;
+    if (more)
+      enqueue(t);
+    pthread_cond_broadcast(&idle_cond);
+  }
+  pthread_mutex_unlock(&queue_lock);
+  return NULL;
+}
+
+// MT_WORKERS overrides the pool size: by default one fewer than the CPUs,
+// at most DEFAULT_MAX_WORKERS.
+static int worker_count(void) {
+  const char *env = getenv("MT_WORKERS");
+  if (env && atoi(env) > 0)
+    return atoi(env);
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus > DEFAULT_MAX_WORKERS + 1)
+    cpus = DEFAULT_MAX_WORKERS + 1;
+  return cpus > 2 ? (int)cpus - 1 : 1;
+}
+
+static int start_threads(void) {
+  if (threads_running)
+    return 0;
+  io_epfd = epoll_create1(EPOLL_CLOEXEC);
+  io_wake_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  notify_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (io_epfd < 0 || io_wake_efd < 0 || notify_efd < 0) {
+    perror("start I/O thread");
+    return -1;
+  }
+  struct epoll_event ev = {.events = EPOLLIN, .data.u64 = 0};
+  epoll_ctl(io_epfd, EPOLL_CTL_ADD, io_wake_efd, &ev);
+  nworkers = worker_count();
+  workers = calloc(nworkers, sizeof(pthread_t));
+  if (!workers) {
+    perror("alloc workers");
+    return -1;
+  }
+  atomic_store(&pool_stop, 0);
+
+  // Signals must be handled on the UI thread.
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  int err = pthread_create(&io_thread, NULL, io_main, NULL);
+  int started = 0;
+  while (!err && started < nworkers &&
+         !(err = pthread_create(&workers[started], NULL, worker_main, NULL)))
+    started++;
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (err) {
+    fprintf(stderr, "pthread_create: %s\n", strerror(err));
+    if (started == 0)
+      exit(EXIT_FAILURE);
+    nworkers = started;
+  }
+  threads_running = 1;
+  return 0;
+}
+
+static void stop_threads(void) {
+  if (threads_running) {
+    atomic_store(&pool_stop, 1);
+    efd_signal(io_wake_efd);
+    pthread_mutex_lock(&queue_lock);
+    pthread_cond_broadcast(&queue_cond);
+    pthread_mutex_unlock(&queue_lock);
+    pthread_join(io_thread, NULL);
+    for (int i = 0; i < nworkers; i++)
+      pthread_join(workers[i], NULL);
+    threads_running = 0;
+  }
+  free(workers);
+  workers = NULL;
+  nworkers = 0;
+  if (io_epfd >= 0)
+    close(io_epfd);
+  if (io_wake_efd >= 0)
+    close(io_wake_efd);
+  if (notify_efd >= 0)
+    close(notify_efd);
+  io_epfd = io_wake_efd = notify_efd = -1;
+}
+
+int terminal_get_fd(void) {
+  if (start_threads() < 0)
+    return -1;
+  return notify_efd;
+}
+
+void terminal_drain_fd(void) {
+  if (notify_efd >= 0)
+    efd_drain(notify_efd);
+}
+
+int terminal_poll(Terminal *t) {
+  if (atomic_load(&t->exited))
+    return -1;
+  uint64_t arrival = atomic_exchange(&t->parsed_arrival, 0);
+  if (arrival && t == term)
+    latency_output_parsed(arrival);
+  return atomic_exchange(&t->changed, 0);
+}
+
+// Shells forked ahead of time by terminal_prefork, waiting for a session.
+#define MAX_WARM_SHELLS 8
+static struct {
+  int fd;
+  pid_t pid;
+} warm[MAX_WARM_SHELLS];
+static int nwarm;
+
+// TERM for the shells. Set on the UI thread before anything forks:
+// setenv is not safe while other threads read the environment.
+static void set_shell_env(void) {
+  const char *t = getenv("TERM");
+  if (!t || strcmp(t, "xterm-256color") != 0)
+    setenv("TERM", "xterm-256color", 1);
+}
+
+// Opens a PTY of rows x cols. Both ends are close-on-exec from the start:
+// workers and the UI thread fork shells at the same time, and a shell
+// that inherited another tab's master or slave would keep that tab from
+// ever seeing its own shell hang up.
+static int open_pty(int rows, int cols, int *master, int *slave) {
+  char name[64];
+  struct winsize ws = {.ws_row = rows, .ws_col = cols};
+  *slave = -1;
+  *master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (*master < 0)
+    return -1;
+  if (grantpt(*master) == 0 && unlockpt(*master) == 0 &&
+      ptsname_r(*master, name, sizeof(name)) == 0 &&
+      (*slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC)) >= 0 &&
+      ioctl(*slave, TIOCSWINSZ, &ws) == 0)
+    return 0;
+  int err = errno;
+  if (*slave >= 0)
+    close(*slave);
+  close(*master);
+  errno = err;
+  return -1;
+}
+
+// Forks an interactive shell on a new PTY of rows x cols and returns its
+// pid, or -1. Other threads may hold locks when we fork, so the child does
+// no more than exec; everything it needs is prepared here.
+static pid_t spawn_shell(int rows, int cols, int *fd) {
+  const char *shell = getenv("SHELL");
+  if (!shell)
+    shell = "/bin/sh";
+  int master, slave;
+  if (open_pty(rows, cols, &master, &slave) < 0)
+    return -1;
+  pid_t pid = fork();
+  if (pid == 0) {
+    // Signals the UI blocks (e.g. SIGUSR1 for signalfd) must not stay
+    // blocked in the shell.
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    // The slave becomes the controlling terminal and stdio; the copies
+    // dup2 makes are not close-on-exec.
+    if (login_tty(slave) < 0)
+      _exit(EXIT_FAILURE);
+    execlp(shell, shell, "-i", NULL);
+    perror("execlp");
+    _exit(EXIT_FAILURE);
+  }
+  int err = errno;
+  close(slave);
+  if (pid < 0) {
+    close(master);
+    errno = err;
+    return -1;
+  }
+  *fd = master;
+  return pid;
+}
+
+// Takes a warm shell that is still running, or returns -1.
+static pid_t take_warm_shell(int *fd) {
+  while (nwarm > 0) {
+    nwarm--;
+    pid_t pid = warm[nwarm].pid;
+    *fd = warm[nwarm].fd;
+    if (waitpid(pid, NULL, WNOHANG) == 0)
+      return pid;
+    close(*fd);
+  }
+  *fd = -1;
+  return -1;
+}
+
+void terminal_prefork(int n, int rows, int cols) {
+  if (n > MAX_WARM_SHELLS)
+    n = MAX_WARM_SHELLS;
+  if (nwarm < n)
+    set_shell_env();
+  while (nwarm < n) {
+    int fd;
+    pid_t pid = spawn_shell(rows, cols, &fd);
+    if (pid < 0) {
+      perror("spawn shell");
+      return;
     }
+    warm[nwarm].fd = fd;
+    warm[nwarm].pid = pid;
+    nwarm++;
+  }
+}
+
+static void free_warm_shells(void) {
+  while (nwarm > 0) {
+    nwarm--;
+    close(warm[nwarm].fd);
+    kill(warm[nwarm].pid, SIGHUP);
+    waitpid(warm[nwarm].pid, NULL, 0);
   }
 }
 
+// Starts reading the current session's shell once it has one.
+static void watch_shell(void) {
+  int flags = fcntl(term->pty_fd, F_GETFL);
+  fcntl(term->pty_fd, F_SETFL, flags | O_NONBLOCK);
+  io_watch(term, term->pty_fd, 0);
+  if (term->prompt_timer_fd >= 0)
+    io_watch(term, term->prompt_timer_fd, 1);
+  arm_prompt_timer();
+}
+
+// Runs on a worker with the session locked; see terminal_start_shell.
+static void fork_pending_shell(void) {
+  term->spawn_pending = 0;
+  term->shell_pid = spawn_shell(term->rows, term->cols, &term->pty_fd);
+  if (term->shell_pid < 0) {
+    perror("spawn shell");
+    term->pty_fd = -1;
+    terminal_write("Failed to start shell: ");
+    terminal_write(strerror(errno));
+    terminal_write("\n");
+    write_prompt();
+    return;
+  }
+  latency_mark("shell forked");
+  watch_shell();
+}
+
 void terminal_start_shell(void) {
-  if (pty_fd != -1) {
+  if (term->pty_fd != -1 || term->spawn_pending) {
     terminal_write("Shell already running\n");
     write_prompt();
     return;
   }
-  struct winsize ws = {
-      .ws_row = term_rows, .ws_col = term_cols, .ws_xpixel = 0, .ws_ypixel = 0};
-  shell_pid = forkpty(&pty_fd, NULL, NULL, &ws);
-  if (shell_pid < 0) {
-    perror("forkpty");
-    terminal_write("Failed to start shell: ");
-    terminal_write(strerror(errno));
-    terminal_write("\n");
+  if (start_threads() < 0 || ring_init(&term->pty_ring, PTY_RING_SIZE) < 0) {
+    terminal_write("Failed to start PTY reader\n");
     write_prompt();
     return;
   }
-  if (shell_pid == 0) {
-    const char *shell = getenv("SHELL");
-    if (!shell)
-      shell = "/bin/sh";
-    setenv("TERM", "xterm-256color", 1);
-    execlp(shell, shell, "-i", NULL);
-    perror("execlp");
-    _exit(EXIT_FAILURE);
+  term->shell_pid = take_warm_shell(&term->pty_fd);
+  if (term->shell_pid > 0) {
+    // It was forked for the default size; its first prompt is already
+    // waiting in the PTY.
+    struct winsize ws = {.ws_row = term->rows, .ws_col = term->cols};
+    ioctl(term->pty_fd, TIOCSWINSZ, &ws);
+    latency_mark("warm shell taken");
+    watch_shell();
+    return;
   }
-
-  signal(SIGCHLD, sigchld_handler);
-
-  int flags = fcntl(pty_fd, F_GETFL);
-  fcntl(pty_fd, F_SETFL, flags | O_NONBLOCK);
-  usleep(100000);
-  terminal_read_output();
-  write_prompt();
+  // Forking a process with an X connection and a few threads takes a
+  // while. A worker does it once the UI thread lets go of the session,
+  // which is after the window is drawn; input typed until then is queued.
+  set_shell_env();
+  term->spawn_pending = 1;
+  pthread_mutex_lock(&queue_lock);
+  enqueue(term);
+  pthread_mutex_unlock(&queue_lock);
 }
 
 void terminal_execute_command(const char *cmd) {
-  if (pty_fd < 0) {
+  if (term->pty_fd < 0 && !term->spawn_pending) {
     terminal_write("Shell not started\n");
     write_prompt();
     return;
   }
-  write(pty_fd, cmd, strlen(cmd));
-  write(pty_fd, "\n", 1);
-  terminal_read_output();
-  write_prompt();
+  terminal_send(cmd, strlen(cmd));
+  terminal_send("\n", 1);
+  arm_prompt_timer();
+}
+
+static void reset_write_queue(void) {
+  free(term->write_buf);
+  term->write_buf = NULL;
+  term->write_off = term->write_len = term->write_cap = 0;
+}
+
+void terminal_send(const char *data, size_t len) {
+  if ((term->pty_fd < 0 && !term->spawn_pending) || len == 0)
+    return;
+  size_t pending = term->write_len - term->write_off;
+  if (pending + len > WRITE_QUEUE_MAX) {
+    fprintf(stderr, "PTY write queue full, dropping %zu bytes\n", len);
+    return;
+  }
+  if (term->write_len + len > term->write_cap) {
+    // Slide the unwritten bytes down before growing.
+    memmove(term->write_buf, term->write_buf + term->write_off, pending);
+    term->write_off = 0;
+    term->write_len = pending;
+    if (term->write_len + len > term->write_cap) {
+      size_t cap = term->write_cap ? term->write_cap : 4096;
+      while (cap < term->write_len + len)
+        cap *= 2;
+      char *buf = realloc(term->write_buf, cap);
+      if (!buf) {
+        perror("realloc write queue");
+        return;
+      }
+      term->write_buf = buf;
+      term->write_cap = cap;
+    }
+  }
+  memcpy(term->write_buf + term->write_len, data, len);
+  term->write_len += len;
+}
+
+void terminal_flush_input(void) {
+  if (!term)
+    return;
+  while (term->pty_fd >= 0 && term->write_off < term->write_len) {
+    ssize_t n = write(term->pty_fd, term->write_buf + term->write_off,
+                      term->write_len - term->write_off);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      // EAGAIN: the rest goes when the PTY is writable again.
+      if (errno != EAGAIN)
+        perror("write pty");
+      break;
+    }
+    term->write_off += n;
+  }
+  if (term->write_off == term->write_len) {
+    term->write_off = term->write_len = 0;
+    if (term->write_cap > WRITE_QUEUE_KEEP)
+      reset_write_queue();
+  }
+}
+
+int terminal_output_backlog(void) {
+  return term && ring_used(&term->pty_ring) > 0;
+}
+
+int terminal_write_pending(void) {
+  return term && term->write_off < term->write_len;
+}
+
+int terminal_get_pty_fd(void) { return term ? term->pty_fd : -1; }
+
+void terminal_paste_begin(void) {
+  term->paste_bracketed = term->bracketed_paste;
+  if (term->paste_bracketed)
+    terminal_send("\033[200~", 6);
+}
+
+// Newlines are sent as carriage returns, as typed. Inside brackets ESC is
+// dropped, so pasted text cannot end the paste early.
+void terminal_paste_data(const char *data, size_t len) {
+  char chunk[4096];
+  size_t n = 0;
+  for (size_t i = 0; i < len; i++) {
+    char c = data[i];
+    if (c == '\n')
+      c = '\r';
+    else if (c == '\033' && term->paste_bracketed)
+      continue;
+    chunk[n++] = c;
+    if (n == sizeof(chunk)) {
+      terminal_send(chunk, n);
+      n = 0;
+    }
+  }
+  terminal_send(chunk, n);
+}
+
+void terminal_paste_end(void) {
+  if (term->paste_bracketed)
+    terminal_send("\033[201~", 6);
+  term->paste_bracketed = 0;
 }
 
 void terminal_move_cursor(int row, int col) {
-  if (row >= 0 && row < term_rows)
-    cursor_row = row;
-  if (col >= 0 && col < term_cols)
-    cursor_col = col;
+  if (row >= 0 && row < term->rows)
+    term->cursor_row = row;
+  if (col >= 0 && col < term->cols)
+    term->cursor_col = col;
+}
+
+int get_cursor_row(void) { return term->cursor_row; }
+int terminal_cursor_visible(void) {
+  return term->cursor_visible && term->view_offset == 0;
+}
+int get_cursor_col(void) { return term->cursor_col; }
+
+void terminal_destroy(Terminal *t) {
+  if (locked == t)
+    terminal_unlock();
+  // Out of the list, the I/O thread reads no more for it; out of the
+  // queue and no longer busy, no worker parses it.
+  pthread_mutex_lock(&sessions_lock);
+  for (int i = 0; i < nsessions; i++) {
+    if (sessions[i] == t) {
+      sessions[i] = sessions[--nsessions];
+      break;
+    }
+  }
+  if (io_epfd >= 0) {
+    io_unwatch(t->pty_fd);
+    io_unwatch(t->prompt_timer_fd);
+  }
+  pthread_mutex_unlock(&sessions_lock);
+  pthread_mutex_lock(&queue_lock);
+  t->closing = 1;
+  unqueue(t);
+  while (t->busy)
+    pthread_cond_wait(&idle_cond, &queue_lock);
+  pthread_mutex_unlock(&queue_lock);
+
+  Terminal *prev = term == t ? NULL : term;
+  use(t);
+  // Closing the master hangs up the shell, which interactive shells
+  // honour even though they ignore SIGTERM.
+  if (t->pty_fd >= 0)
+    close(t->pty_fd);
+  if (t->shell_pid > 0) {
+    kill(t->shell_pid, SIGHUP);
+    waitpid(t->shell_pid, NULL, 0);
+  }
+  if (t->prompt_timer_fd >= 0)
+    close(t->prompt_timer_fd);
+  free(t->grid);
+  free(t->spare_grid);
+  free(t->prompt);
+  free(t->damage_bits);
+  free(t->damage_lo);
+  free(t->damage_hi);
+  free(t->view_row);
+  scrollback_free();
+  reset_write_queue();
+  ring_free(&t->pty_ring);
+  pthread_mutex_destroy(&t->lock);
+  free(t);
+  use(prev);
+}
+
+void terminal_counters(TerminalCounters *c) {
+  c->bytes_read = atomic_load_explicit(&bytes_read, memory_order_relaxed);
+  c->bytes_parsed = atomic_load_explicit(&bytes_parsed, memory_order_relaxed);
+  c->escapes = atomic_load_explicit(&escapes_seen, memory_order_relaxed);
 }
 
-int get_cursor_row(void) { return cursor_row; }
-int get_cursor_col(void) { return cursor_col; }
+// Sessions are only added and removed on the UI thread, so the list can be
+// walked here without sessions_lock. Each session other than the locked
+// one is locked while its sizes are read, which waits at most for one
+// parse slice.
+void terminal_memory(size_t *grid, size_t *history) {
+  *grid = *history = 0;
+  Terminal *self = term;
+  for (int i = 0; i < nsessions; i++) {
+    Terminal *t = sessions[i];
+    if (t != locked)
+      pthread_mutex_lock(&t->lock);
+    *grid += t->grid_cap + t->spare_cap +
+             (size_t)t->view_row_cols * sizeof(Cell) +
+             (size_t)(t->damage_cap + 63) / 64 * sizeof(uint64_t) +
+             (size_t)t->damage_cap * 2 * sizeof(int);
+    ScrollbackStats sb;
+    scrollback_select(t->history);
+    scrollback_stats(&sb);
+    *history += sb.resident;
+    if (t != locked)
+      pthread_mutex_unlock(&t->lock);
+  }
+  use(self);
+}
 
 void terminal_cleanup(void) {
-  if (shell_pid > 0) {
-    kill(shell_pid, SIGTERM);
-    waitpid(shell_pid, NULL, 0);
-  }
-  if (pty_fd >= 0)
-    close(pty_fd);
-  for (int i = 0; i < term_rows; ++i)
-    free(buffer[i]);
-  free(buffer);
-  free(prompt);
-  buffer = NULL;
-  prompt = NULL;
-  pty_fd = -1;
-  shell_pid = -1;
+  search_free();
+  terminal_unlock();
+  while (nsessions > 0)
+    terminal_destroy(sessions[nsessions - 1]);
+  stop_threads();
+  free_warm_shells();
+  free(sessions);
+  sessions = NULL;
+  sessions_cap = 0;
 }
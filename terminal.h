@@ -14,26 +14,126 @@
 #include <termios.h>
 #include <signal.h>
 #include <sys/ioctl.h>
+#include <stddef.h>
+#include <stdint.h>
 
 // Terminal dimensions
 #define TERM_ROWS 24
 #define TERM_COLS 80
 
-void init_terminal(int rows, int cols);
-const char** get_terminal_buffer();
+#define CELL_DEFAULT_FG ANSI_COLOR_WHITE
+#define CELL_DEFAULT_BG ANSI_COLOR_BLACK
+
+// One screen cell. Eight bytes, so a 64-byte cache line holds eight cells.
+typedef struct {
+  uint32_t ch; // Unicode codepoint
+  uint8_t fg;
+  uint8_t bg;
+  uint16_t attr;
+} Cell;
+
+_Static_assert(sizeof(Cell) == 8 && offsetof(Cell, ch) == 0,
+               "put_ascii_run stores cells as 64-bit words");
+
+#define CELLS_PER_LINE (64 / sizeof(Cell))
+
+// A session: one shell with its screen, history and parser state. The
+// functions below act on the current session of the calling thread.
+// Sessions are created and destroyed on the UI thread; while the UI
+// thread reads or changes the current session it holds terminal_lock,
+// which keeps the parser workers off it.
+typedef struct Terminal Terminal;
+
+// Creates a session and makes it current.
+Terminal* terminal_create(int rows, int cols);
+void terminal_destroy(Terminal* t);
+// Moves the lock along if the calling thread holds one.
+void terminal_select(Terminal* t);
+Terminal* terminal_current();
+// Unique per session, never reused.
+unsigned terminal_id();
+void terminal_lock();
+void terminal_unlock();
+const Cell* get_terminal_row(int row);
+// Damage tracking: returns the first damaged row >= from with its damaged
+// column range [*c0, *c1), or -1. The renderer clears it after a frame.
+int terminal_next_damaged_row(int from, int *c0, int *c1);
+void terminal_clear_damage();
+// Scrollback viewport: lines the view is scrolled back into the history
+// (0 is the live screen). While scrolled back, get_terminal_row returns
+// history rows and the cursor is hidden.
+void terminal_scroll_view(int lines);
+int terminal_view_offset();
+// Live screen row, whatever the view shows.
+const Cell* terminal_screen_row(int row);
+// Repaints every row in the next frame, e.g. when highlights change.
+void terminal_redraw_view();
 int get_terminal_rows();
 int get_terminal_cols();
 void terminal_write(const char* text);
+void terminal_feed(const char* text, size_t len);
 void terminal_move_cursor(int row, int col);
 int get_cursor_row();
 int get_cursor_col();
+int terminal_cursor_visible();
 void terminal_execute_command(const char* cmd);
+// Raw mode sends keys straight to the shell, which does its own echo,
+// line editing and prompt. Set it before terminal_create.
+void terminal_set_raw_mode(int on);
+int terminal_raw_mode();
+// Line mode: the line typed so far, kept per session until Enter.
+#define MAX_INPUT_LINE 1024
+typedef struct {
+  char text[MAX_INPUT_LINE];
+  int len;
+} InputLine;
+InputLine* terminal_input_line();
+// DECCKM: cursor keys send SS3 rather than CSI sequences.
+int terminal_app_cursor_keys();
+// Queues bytes for the shell. terminal_flush_input writes as much as the
+// PTY takes without blocking; while terminal_write_pending, the caller
+// should wait for terminal_get_pty_fd to become writable and flush again.
+void terminal_send(const char* data, size_t len);
+void terminal_flush_input();
+int terminal_write_pending();
+int terminal_get_pty_fd();
+// Pastes are wrapped in ESC[200~ / ESC[201~ when the application has
+// enabled bracketed paste. The data may arrive in several pieces.
+void terminal_paste_begin();
+void terminal_paste_data(const char* data, size_t len);
+void terminal_paste_end();
+// Destroys every session and stops the I/O thread and the workers.
 void terminal_cleanup();
 void terminal_set_prompt(const char* prompt);
 const char* terminal_get_prompt();
 void resize_terminal(int new_rows, int new_cols);
 void terminal_clear();
+// Starts the current session's shell, taking a warm one if there is one.
 void terminal_start_shell();
-void terminal_read_output(void);
+// Forks shells ahead of time until n (at most 8) are waiting, so a new
+// session does not wait for fork and exec. They are sized rows x cols and
+// resized when taken.
+void terminal_prefork(int n, int rows, int cols);
+// Output is waiting that the parser has not got to yet, i.e. the shell is
+// producing it faster than we parse.
+int terminal_output_backlog(void);
+// Shell output is read and parsed off the UI thread. terminal_get_fd
+// becomes readable when a session has parsed some; terminal_drain_fd
+// resets it, and terminal_poll then tells for each session whether its
+// screen changed (1) or its shell has exited (-1).
+int terminal_get_fd(void);
+void terminal_drain_fd(void);
+int terminal_poll(Terminal* t);
+// Totals since startup over all sessions, for stats.c. They may be read
+// from any thread.
+typedef struct {
+  uint64_t bytes_read;   // from the PTYs
+  uint64_t bytes_parsed; // including text that fast-forward skipped
+  uint64_t escapes;      // ESC, CSI and OSC sequences dispatched
+} TerminalCounters;
+void terminal_counters(TerminalCounters* c);
+// Heap held by every session's screen and by their histories, in bytes.
+// UI thread only.
+void terminal_memory(size_t* grid, size_t* history);
 void write_prompt(void);
 #endif // TERMINAL_H